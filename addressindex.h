@@ -0,0 +1,191 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef ADDRESSINDEX_H
+#define ADDRESSINDEX_H
+
+#include <algorithm>
+#include <vector>
+
+#include <stdint.h>
+
+
+/// A range of absolute addresses, from start to end (excluded).
+struct AddressRange {
+	AddressRange(uint64_t start = 0, uint64_t end = 0)
+		: start(start)
+		, end(end)
+	{
+	}
+
+	bool Contains(uint64_t address) const
+		{ return address >= start && address < end; }
+	bool Intersects(const AddressRange& other) const
+		{ return start < other.end && other.start < end; }
+	uint64_t Size() const { return end - start; }
+
+	bool operator==(const AddressRange& other) const
+		{ return start == other.start && end == other.end; }
+
+	uint64_t start;
+	uint64_t end;
+};
+
+
+/// Index of the data records of an image by absolute address.
+/// Entries are added in file order, then sorted once. Lookups are binary
+/// searches, and contiguous or overlapping data is also merged in segments
+/// to answer range queries. Records are at most 255 bytes, so an entry
+/// containing an address always starts less than 255 bytes before it.
+class AddressIndex {
+	public:
+		struct Entry {
+			uint64_t start;
+				// Absolute address of the first byte
+			uint32_t size;
+			uint32_t record;
+				// Index of the record in the file
+
+			uint64_t End() const { return start + size; }
+			bool operator<(const Entry& other) const
+				{ return start < other.start; }
+		};
+
+		void Clear();
+		void Add(uint64_t start, uint32_t size, uint32_t record);
+		void Finish();
+			// Sort the entries and build the segments, after the last Add.
+		void Load(const Entry* entries, size_t count,
+			const AddressRange* segments, size_t segmentCount,
+			const AddressRange* overlaps, size_t overlapCount);
+			// Restore an index saved from the accessors below, instead of
+			// adding the entries again.
+
+		const Entry* Find(uint64_t address) const;
+			// Entry containing the address, the last one in the file if
+			// several records overlap there. NULL if no data there.
+		void Query(const AddressRange& range,
+			std::vector<const Entry*>& entries) const;
+			// Entries with data in the range, by address.
+		bool Contains(const AddressRange& range) const;
+			// Whether there is data anywhere in the range.
+
+		const std::vector<Entry>& Entries() const { return fEntries; }
+		const std::vector<AddressRange>& Segments() const { return fSegments; }
+			// Contiguous data areas, by address.
+		const std::vector<AddressRange>& Overlaps() const { return fOverlaps; }
+			// Areas defined by more than one record.
+
+	private:
+		size_t FirstCandidate(uint64_t address) const;
+
+		std::vector<Entry> fEntries;
+		std::vector<AddressRange> fSegments;
+		std::vector<AddressRange> fOverlaps;
+};
+
+
+void AddressIndex::Clear()
+{
+	fEntries.clear();
+	fSegments.clear();
+	fOverlaps.clear();
+}
+
+
+void AddressIndex::Add(uint64_t start, uint32_t size, uint32_t record)
+{
+	if (size == 0)
+		return;
+
+	Entry entry = { start, size, record };
+	fEntries.push_back(entry);
+}
+
+
+void AddressIndex::Finish()
+{
+	// Files are usually in address order already, so this is a linear check.
+	// Keep the file order for records at the same address.
+	if (!std::is_sorted(fEntries.begin(), fEntries.end()))
+		std::stable_sort(fEntries.begin(), fEntries.end());
+
+	fSegments.clear();
+	fOverlaps.clear();
+	for (const Entry& entry: fEntries) {
+		if (fSegments.empty() || entry.start > fSegments.back().end) {
+			fSegments.push_back(AddressRange(entry.start, entry.End()));
+			continue;
+		}
+
+		AddressRange& last = fSegments.back();
+		if (entry.start < last.end) {
+			AddressRange overlap(entry.start, std::min(last.end, entry.End()));
+			if (!fOverlaps.empty() && overlap.start <= fOverlaps.back().end)
+				fOverlaps.back().end = std::max(fOverlaps.back().end, overlap.end);
+			else
+				fOverlaps.push_back(overlap);
+		}
+		last.end = std::max(last.end, entry.End());
+	}
+}
+
+
+void AddressIndex::Load(const Entry* entries, size_t count,
+	const AddressRange* segments, size_t segmentCount,
+	const AddressRange* overlaps, size_t overlapCount)
+{
+	fEntries.assign(entries, entries + count);
+	fSegments.assign(segments, segments + segmentCount);
+	fOverlaps.assign(overlaps, overlaps + overlapCount);
+}
+
+
+/// First entry which may contain the address.
+size_t AddressIndex::FirstCandidate(uint64_t address) const
+{
+	Entry key = { address < 255 ? 0 : address - 255, 0, 0 };
+	return std::lower_bound(fEntries.begin(), fEntries.end(), key)
+		- fEntries.begin();
+}
+
+
+const AddressIndex::Entry* AddressIndex::Find(uint64_t address) const
+{
+	const Entry* found = NULL;
+	for (size_t i = FirstCandidate(address);
+			i < fEntries.size() && fEntries[i].start <= address; i++) {
+		const Entry& entry = fEntries[i];
+		if (address < entry.End()
+			&& (found == NULL || entry.record > found->record)) {
+			found = &entry;
+		}
+	}
+	return found;
+}
+
+
+void AddressIndex::Query(const AddressRange& range,
+	std::vector<const Entry*>& entries) const
+{
+	entries.clear();
+	for (size_t i = FirstCandidate(range.start);
+			i < fEntries.size() && fEntries[i].start < range.end; i++) {
+		if (fEntries[i].End() > range.start)
+			entries.push_back(&fEntries[i]);
+	}
+}
+
+
+bool AddressIndex::Contains(const AddressRange& range) const
+{
+	// The first segment ending after the start of the range
+	auto segment = std::upper_bound(fSegments.begin(), fSegments.end(),
+		range.start, [](uint64_t address, const AddressRange& segment) {
+			return address < segment.end;
+		});
+	return segment != fSegments.end() && segment->start < range.end;
+}
+
+#endif
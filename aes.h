@@ -0,0 +1,249 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef AES_H
+#define AES_H
+
+/// AES-128 block encryption, as used by the CTR mode cipher engine.
+/// There is a portable byte-oriented implementation, and variants using the
+/// AES instructions of x86 (AES-NI) and ARMv8 (crypto extensions). The best
+/// one for the running CPU is selected at runtime.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define AES_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define AES_ARMV8 1
+#include <arm_neon.h>
+#endif
+
+
+/// Round keys of AES-128, in the byte order of the standard.
+struct aes128_key {
+	uint8_t rounds[11][16];
+};
+
+
+/// Encrypt 16-byte blocks.
+/// @key the expanded key.
+/// @in the blocks to encrypt, one after the other.
+/// @out where to store the encrypted blocks, may be the same as in.
+/// @count number of blocks.
+typedef void (*aes_encrypt_func)(const aes128_key* key, const uint8_t* in,
+	uint8_t* out, size_t count);
+
+
+static const uint8_t kAesSbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+
+/// Compute the round keys from a 16-byte key.
+static void aes128_expand_key(const uint8_t key[16], aes128_key* expanded)
+{
+	uint8_t* w = &expanded->rounds[0][0];
+	memcpy(w, key, 16);
+
+	uint8_t rcon = 1;
+	for (int i = 16; i < 176; i += 4) {
+		uint8_t t[4] = { w[i - 4], w[i - 3], w[i - 2], w[i - 1] };
+		if (i % 16 == 0) {
+			// RotWord, SubWord and the round constant
+			uint8_t first = t[0];
+			t[0] = kAesSbox[t[1]] ^ rcon;
+			t[1] = kAesSbox[t[2]];
+			t[2] = kAesSbox[t[3]];
+			t[3] = kAesSbox[first];
+			rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0);
+		}
+		for (int k = 0; k < 4; k++)
+			w[i + k] = w[i + k - 16] ^ t[k];
+	}
+}
+
+
+static inline uint8_t aes_xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+
+static void aes128_encrypt_scalar(const aes128_key* key, const uint8_t* in,
+	uint8_t* out, size_t count)
+{
+	for (size_t b = 0; b < count; b++, in += 16, out += 16) {
+		uint8_t s[16];
+		for (int i = 0; i < 16; i++)
+			s[i] = in[i] ^ key->rounds[0][i];
+
+		for (int round = 1; round <= 10; round++) {
+			// SubBytes and ShiftRows, the state is stored column by column
+			uint8_t t[16];
+			for (int c = 0; c < 4; c++) {
+				for (int r = 0; r < 4; r++)
+					t[4 * c + r] = kAesSbox[s[4 * ((c + r) % 4) + r]];
+			}
+
+			if (round < 10) {
+				// MixColumns
+				for (int c = 0; c < 4; c++) {
+					uint8_t* col = t + 4 * c;
+					uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+					uint8_t first = col[0];
+					col[0] ^= all ^ aes_xtime(col[0] ^ col[1]);
+					col[1] ^= all ^ aes_xtime(col[1] ^ col[2]);
+					col[2] ^= all ^ aes_xtime(col[2] ^ col[3]);
+					col[3] ^= all ^ aes_xtime(col[3] ^ first);
+				}
+			}
+
+			for (int i = 0; i < 16; i++)
+				s[i] = t[i] ^ key->rounds[round][i];
+		}
+		memcpy(out, s, 16);
+	}
+}
+
+
+#ifdef AES_X86
+__attribute__((target("aes,sse2")))
+static void aes128_encrypt_aesni(const aes128_key* key, const uint8_t* in,
+	uint8_t* out, size_t count)
+{
+	__m128i k[11];
+	for (int i = 0; i < 11; i++)
+		k[i] = _mm_loadu_si128((const __m128i*)key->rounds[i]);
+
+	size_t b = 0;
+	// Four blocks at a time, to hide the latency of the instructions
+	for (; b + 4 <= count; b += 4) {
+		__m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * b)), k[0]);
+		__m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * b + 16)), k[0]);
+		__m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * b + 32)), k[0]);
+		__m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * b + 48)), k[0]);
+		for (int r = 1; r < 10; r++) {
+			x0 = _mm_aesenc_si128(x0, k[r]);
+			x1 = _mm_aesenc_si128(x1, k[r]);
+			x2 = _mm_aesenc_si128(x2, k[r]);
+			x3 = _mm_aesenc_si128(x3, k[r]);
+		}
+		_mm_storeu_si128((__m128i*)(out + 16 * b), _mm_aesenclast_si128(x0, k[10]));
+		_mm_storeu_si128((__m128i*)(out + 16 * b + 16), _mm_aesenclast_si128(x1, k[10]));
+		_mm_storeu_si128((__m128i*)(out + 16 * b + 32), _mm_aesenclast_si128(x2, k[10]));
+		_mm_storeu_si128((__m128i*)(out + 16 * b + 48), _mm_aesenclast_si128(x3, k[10]));
+	}
+
+	for (; b < count; b++) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * b)), k[0]);
+		for (int r = 1; r < 10; r++)
+			x = _mm_aesenc_si128(x, k[r]);
+		_mm_storeu_si128((__m128i*)(out + 16 * b), _mm_aesenclast_si128(x, k[10]));
+	}
+}
+#endif
+
+
+#ifdef AES_ARMV8
+static void aes128_encrypt_armv8(const aes128_key* key, const uint8_t* in,
+	uint8_t* out, size_t count)
+{
+	uint8x16_t k[11];
+	for (int i = 0; i < 11; i++)
+		k[i] = vld1q_u8(key->rounds[i]);
+
+	for (size_t b = 0; b < count; b++) {
+		// AESE adds the round key before SubBytes and ShiftRows
+		uint8x16_t x = vld1q_u8(in + 16 * b);
+		for (int r = 0; r < 9; r++)
+			x = vaesmcq_u8(vaeseq_u8(x, k[r]));
+		x = veorq_u8(vaeseq_u8(x, k[9]), k[10]);
+		vst1q_u8(out + 16 * b, x);
+	}
+}
+#endif
+
+
+/// An implementation of AES for a given instruction set.
+struct aes_kernel {
+	const char* name;
+	aes_encrypt_func encrypt;
+	bool available;
+};
+
+
+/// All the implementations built in, best first, and whether the CPU can run
+/// them.
+static const aes_kernel* aes_kernels(size_t* count)
+{
+	static const aes_kernel kernels[] = {
+#ifdef AES_X86
+		{ "aesni", aes128_encrypt_aesni, (bool)__builtin_cpu_supports("aes") },
+#endif
+#ifdef AES_ARMV8
+		{ "armv8", aes128_encrypt_armv8, true },
+#endif
+		{ "scalar", aes128_encrypt_scalar, true },
+	};
+
+	*count = sizeof(kernels) / sizeof(kernels[0]);
+	return kernels;
+}
+
+
+static const aes_kernel& aes_select_kernel()
+{
+	size_t count;
+	const aes_kernel* kernels = aes_kernels(&count);
+	for (size_t i = 0; i < count; i++) {
+		if (kernels[i].available)
+			return kernels[i];
+	}
+	return kernels[count - 1];
+}
+
+
+/// The best implementation for the running CPU.
+static inline const aes_kernel& aes_best_kernel()
+{
+	static const aes_kernel& best = aes_select_kernel();
+	return best;
+}
+
+#endif
@@ -8,6 +8,9 @@
                * http://en.wikipedia.org/wiki/RC4
 *********************************************************************/
 
+#ifndef ARCFOUR_H
+#define ARCFOUR_H
+
 /*********************** FUNCTION DEFINITIONS ***********************/
 void arcfour_key_setup(uint8_t state[], const uint8_t key[], int len)
 {
@@ -39,3 +42,5 @@ void arcfour_generate_stream(uint8_t state[], uint8_t out[], size_t len)
 		out[idx] = state[(state[i] + state[j]) % 256];
 	}
 }
+
+#endif
@@ -0,0 +1,374 @@
+#include "ihex.h"
+
+#include <chrono>
+#include <thread>
+
+#include <stdlib.h>
+
+
+static std::string slurp(const char* filename)
+{
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
+
+
+/// An ihex image to run the benchmarks on.
+struct Image {
+	std::string name;
+	std::string text;
+	size_t records;
+	size_t payload;
+		// Number of data bytes in data records
+};
+
+
+/// Append a record to an ihex text.
+static void AppendRecord(std::string& text, uint8_t type, uint16_t address,
+	const uint8_t* data, uint8_t size)
+{
+	uint8_t bytes[260] = { size, (uint8_t)(address >> 8), (uint8_t)address, type };
+	uint8_t sum = 0;
+	for (int i = 0; i < size; i++)
+		bytes[i + 4] = data[i];
+	for (int i = 0; i < size + 4; i++)
+		sum += bytes[i];
+	bytes[size + 4] = -sum;
+
+	char line[523];
+	line[0] = ':';
+	hex_encode_scalar(bytes, size + 5, line + 1, false);
+	line[2 * size + 11] = '\r';
+	line[2 * size + 12] = '\n';
+	text.append(line, 2 * size + 13);
+}
+
+
+/// Generate a synthetic image.
+/// @size approximate size of the text, in bytes.
+/// @wide use 32-bit addresses (type 4 records) instead of 16-bit segments
+/// (type 2 records).
+/// @recordLength number of data bytes per record.
+/// @sparse leave a gap after each 256 bytes of data, instead of filling the
+/// address space.
+static Image Synthesize(size_t size, bool wide, int recordLength, bool sparse)
+{
+	Image image;
+	std::ostringstream name;
+	name << size / 1000000 << "MB/" << (wide ? 32 : 16) << "bit/"
+		<< recordLength << "B/" << (sparse ? "sparse" : "dense");
+	image.name = name.str();
+	image.text.reserve(size + 1024);
+	image.records = 0;
+	image.payload = 0;
+
+	uint8_t data[255];
+	uint32_t random = 0x12345678;
+	uint32_t address = 0;
+	uint32_t base = 0xFFFFFFFF;
+
+	while (image.text.size() < size) {
+		// Don't let records cross a 64K boundary
+		uint32_t length = recordLength;
+		if ((address & 0xFFFF) + length > 0x10000)
+			length = 0x10000 - (address & 0xFFFF);
+
+		if (address >> 16 != base) {
+			base = address >> 16;
+			uint8_t value[2];
+			if (wide) {
+				value[0] = base >> 8;
+				value[1] = base;
+			} else {
+				// Segment base is value * 16, wrapping in the 1MB space
+				value[0] = (base << 12) >> 8;
+				value[1] = 0;
+			}
+			AppendRecord(image.text, wide ? 4 : 2, 0, value, 2);
+			image.records++;
+		}
+
+		for (uint32_t i = 0; i < length; i++) {
+			random = random * 1103515245 + 12345;
+			data[i] = random >> 24;
+		}
+		AppendRecord(image.text, 0, address, data, length);
+		image.records++;
+		image.payload += length;
+
+		uint32_t next = address + length;
+		if (sparse && (next & ~0xFF) != (address & ~0xFF))
+			next = (next & ~0xFF) + 256;
+		address = next;
+	}
+
+	AppendRecord(image.text, 1, 0, NULL, 0);
+	image.records++;
+	return image;
+}
+
+
+/// Use an existing ihex file as image.
+static Image Load(const char* filename)
+{
+	Image image;
+	image.name = filename;
+	image.text = slurp(filename);
+	image.records = 0;
+	image.payload = 0;
+
+	std::istringstream lines(image.text);
+	std::string line;
+	while (std::getline(lines, line)) {
+		image.records++;
+		if (line.size() >= 9 && line.compare(7, 2, "00") == 0)
+			image.payload += strtoul(line.substr(1, 2).c_str(), NULL, 16);
+	}
+	return image;
+}
+
+
+struct Result {
+	std::string image;
+	std::string phase;
+	double megabytesPerSecond;
+	double nanosecondsPerRecord;
+};
+
+
+enum OutputFormat {
+	kText,
+	kCSV,
+	kJSON
+};
+
+
+static void Print(const std::vector<Result>& results, OutputFormat format)
+{
+	switch (format) {
+		case kText:
+			printf("%-28s %-16s %10s %12s\n", "image", "phase", "MB/s",
+				"ns/record");
+			for (const auto& r: results) {
+				printf("%-28s %-16s %10.1f %12.1f\n", r.image.c_str(),
+					r.phase.c_str(), r.megabytesPerSecond, r.nanosecondsPerRecord);
+			}
+			break;
+
+		case kCSV:
+			puts("image,phase,mb_per_s,ns_per_record");
+			for (const auto& r: results) {
+				printf("%s,%s,%.2f,%.2f\n", r.image.c_str(), r.phase.c_str(),
+					r.megabytesPerSecond, r.nanosecondsPerRecord);
+			}
+			break;
+
+		case kJSON:
+			puts("[");
+			for (size_t i = 0; i < results.size(); i++) {
+				const Result& r = results[i];
+				printf("  {\"image\": \"%s\", \"phase\": \"%s\", "
+					"\"mb_per_s\": %.2f, \"ns_per_record\": %.2f}%s\n",
+					r.image.c_str(), r.phase.c_str(), r.megabytesPerSecond,
+					r.nanosecondsPerRecord, i + 1 < results.size() ? "," : "");
+			}
+			puts("]");
+			break;
+	}
+}
+
+
+/// Run a function repeatedly for at least the given time.
+/// @returns the time taken by one run, in seconds.
+template<typename Function>
+static double Measure(Function function, double minimum = 0.3)
+{
+	auto start = std::chrono::steady_clock::now();
+	double elapsed;
+	int iterations = 0;
+	do {
+		function();
+		iterations++;
+		elapsed = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < minimum);
+	return elapsed / iterations;
+}
+
+
+static void Run(const Image& image, std::vector<Result>& results)
+{
+	const CipherContext context((const uint8_t*)"I'm an unsafe key", 18);
+
+	IntelHex hex;
+	double parse = Measure([&]() {
+		hex.Read(image.text.data(), image.text.size());
+	});
+
+	double cipher = Measure([&]() {
+		hex.Cipher(context);
+	});
+
+	uint8_t engineKey[32];
+	for (int i = 0; i < 32; i++)
+		engineKey[i] = i;
+	std::unique_ptr<CipherEngine> aes
+		= CipherEngine::Create("aes-ctr", engineKey, 32);
+	std::unique_ptr<CipherEngine> chacha
+		= CipherEngine::Create("chacha20", engineKey, 32);
+	double aesCipher = Measure([&]() {
+		hex.Cipher(*aes);
+	});
+	double chachaCipher = Measure([&]() {
+		hex.Cipher(*chacha);
+	});
+
+	std::vector<char> output(hex.GeneratedSize());
+	double generate = Measure([&]() {
+		hex.Write(output.data(), output.size());
+	});
+
+	hex.SetDigests(true);
+	double digests = Measure([&]() {
+		hex.Write(output.data(), output.size());
+	});
+	hex.SetDigests(false);
+
+	// Two identical images, so all the blocks are hashed and none compared
+	IntelHex copy = hex;
+	double diff = Measure([&]() {
+		hex.Diff(copy);
+	});
+
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	hex.SetThreads(threads);
+	double parallelParse = Measure([&]() {
+		hex.Read(image.text.data(), image.text.size());
+	});
+	double parallelCipher = Measure([&]() {
+		hex.Cipher(context);
+	});
+	double parallelGenerate = Measure([&]() {
+		hex.Write(output.data(), output.size());
+	});
+	hex.SetThreads(1);
+
+	double all = Measure([&]() {
+		IntelHex file;
+		file.Read(image.text.data(), image.text.size());
+		file.Cipher(context);
+		std::vector<char> buffer(file.GeneratedSize());
+		file.Write(buffer.data(), buffer.size());
+	});
+
+	struct {
+		const char* phase;
+		double seconds;
+		size_t bytes;
+	} phases[] = {
+		{ "parse", parse, image.text.size() },
+		{ "cipher", cipher, image.payload },
+		{ "cipher/aes-ctr", aesCipher, image.payload },
+		{ "cipher/chacha20", chachaCipher, image.payload },
+		{ "generate", generate, output.size() },
+		{ "generate/digests", digests, output.size() },
+		{ "diff", diff, image.payload },
+		{ "parse/mt", parallelParse, image.text.size() },
+		{ "cipher/mt", parallelCipher, image.payload },
+		{ "generate/mt", parallelGenerate, output.size() },
+		{ "total", all, image.text.size() },
+	};
+
+	for (const auto& phase: phases) {
+		Result result = { image.name, phase.phase,
+			phase.bytes / phase.seconds / 1e6,
+			phase.seconds * 1e9 / image.records };
+		results.push_back(result);
+	}
+}
+
+
+static void KeySetup(std::vector<Result>& results)
+{
+	const uint8_t* key = (const uint8_t*)"I'm an unsafe key";
+	uint8_t state[256];
+
+	const int count = 10000;
+	double setup = Measure([&]() {
+		for (int i = 0; i < count; i++)
+			CipherContext(key, 18).CopyState(state);
+	}) / count;
+
+	CipherContextCache cache;
+	double cached = Measure([&]() {
+		for (int i = 0; i < count; i++)
+			cache.Get(key, 18).CopyState(state);
+	}) / count;
+
+	// One "record" is one key setup here
+	Result uncachedResult = { "-", "keysetup", 256 / setup / 1e6, setup * 1e9 };
+	Result cachedResult = { "-", "keycache", 256 / cached / 1e6, cached * 1e9 };
+	results.push_back(uncachedResult);
+	results.push_back(cachedResult);
+}
+
+
+int main(int argc, char* argv[])
+{
+	OutputFormat format = kText;
+	size_t maximum = 16;
+	const char* filter = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--csv") == 0)
+			format = kCSV;
+		else if (strcmp(argv[i], "--json") == 0)
+			format = kJSON;
+		else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc)
+			maximum = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+			filter = argv[++i];
+		else {
+			fprintf(stderr, "%s [--csv|--json] [--max-size MB] [--filter text]\n"
+				"Benchmark parsing, ciphering and generating ihex files.\n"
+				"Images from 1 MB up to the maximum size (16 MB by default, up\n"
+				"to 1024) are generated with 16 and 32-bit addresses, several\n"
+				"record lengths, and dense or sparse data. --filter only runs\n"
+				"the images with the given text in their name.\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+	KeySetup(results);
+
+	Image sample = Load("tests/03.hex");
+	if (filter == NULL || sample.name.find(filter) != std::string::npos)
+		Run(sample, results);
+
+	static const size_t sizes[] = { 1, 16, 64, 256, 1024 };
+	static const int lengths[] = { 16, 32, 255 };
+	for (size_t size: sizes) {
+		if (size > maximum)
+			break;
+		for (int wide = 0; wide < 2; wide++) {
+			for (int length: lengths) {
+				for (int sparse = 0; sparse < 2; sparse++) {
+					// Keep the large images to the most common layout
+					if (size > 16 && (length != 16 || sparse || !wide))
+						continue;
+
+					Image image = Synthesize(size * 1000000, wide, length,
+						sparse);
+					if (filter == NULL
+						|| image.name.find(filter) != std::string::npos)
+						Run(image, results);
+				}
+			}
+		}
+	}
+
+	Print(results, format);
+}
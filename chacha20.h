@@ -0,0 +1,278 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+/// The ChaCha20 block function of RFC 8439. There is a portable version
+/// producing one 64-byte block at a time, and SSE2 and NEON versions producing
+/// four blocks at once, one in each lane of the vector registers.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define CHACHA_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CHACHA_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+/// Generate keystream blocks.
+/// @key 8 words of key.
+/// @nonce 3 words of nonce.
+/// @counter block counter of the first block.
+/// @out where to store the blocks, 64 bytes each.
+/// @count number of blocks.
+typedef void (*chacha_blocks_func)(const uint32_t key[8],
+	const uint32_t nonce[3], uint32_t counter, uint8_t* out, size_t count);
+
+
+static inline uint32_t chacha_rotate(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+
+static inline void chacha_store32(uint8_t* out, uint32_t value)
+{
+	out[0] = value;
+	out[1] = value >> 8;
+	out[2] = value >> 16;
+	out[3] = value >> 24;
+}
+
+
+static void chacha_setup(uint32_t state[16], const uint32_t key[8],
+	const uint32_t nonce[3], uint32_t counter)
+{
+	state[0] = 0x61707865;
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (int i = 0; i < 8; i++)
+		state[4 + i] = key[i];
+	state[12] = counter;
+	state[13] = nonce[0];
+	state[14] = nonce[1];
+	state[15] = nonce[2];
+}
+
+
+#define CHACHA_QUARTER(x, a, b, c, d) \
+	x[a] += x[b]; x[d] = chacha_rotate(x[d] ^ x[a], 16); \
+	x[c] += x[d]; x[b] = chacha_rotate(x[b] ^ x[c], 12); \
+	x[a] += x[b]; x[d] = chacha_rotate(x[d] ^ x[a], 8); \
+	x[c] += x[d]; x[b] = chacha_rotate(x[b] ^ x[c], 7)
+
+
+static void chacha20_blocks_scalar(const uint32_t key[8],
+	const uint32_t nonce[3], uint32_t counter, uint8_t* out, size_t count)
+{
+	uint32_t state[16];
+	chacha_setup(state, key, nonce, counter);
+
+	for (size_t b = 0; b < count; b++, out += 64) {
+		uint32_t x[16];
+		for (int i = 0; i < 16; i++)
+			x[i] = state[i];
+
+		for (int round = 0; round < 10; round++) {
+			CHACHA_QUARTER(x, 0, 4, 8, 12);
+			CHACHA_QUARTER(x, 1, 5, 9, 13);
+			CHACHA_QUARTER(x, 2, 6, 10, 14);
+			CHACHA_QUARTER(x, 3, 7, 11, 15);
+			CHACHA_QUARTER(x, 0, 5, 10, 15);
+			CHACHA_QUARTER(x, 1, 6, 11, 12);
+			CHACHA_QUARTER(x, 2, 7, 8, 13);
+			CHACHA_QUARTER(x, 3, 4, 9, 14);
+		}
+
+		for (int i = 0; i < 16; i++)
+			chacha_store32(out + 4 * i, x[i] + state[i]);
+		state[12]++;
+	}
+}
+
+
+#ifdef CHACHA_X86
+__attribute__((target("sse2")))
+static inline __m128i chacha_rotate_sse2(__m128i x, int n)
+{
+	return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+}
+
+
+#define CHACHA_QUARTER_SSE2(x, a, b, c, d) \
+	x[a] = _mm_add_epi32(x[a], x[b]); \
+	x[d] = chacha_rotate_sse2(_mm_xor_si128(x[d], x[a]), 16); \
+	x[c] = _mm_add_epi32(x[c], x[d]); \
+	x[b] = chacha_rotate_sse2(_mm_xor_si128(x[b], x[c]), 12); \
+	x[a] = _mm_add_epi32(x[a], x[b]); \
+	x[d] = chacha_rotate_sse2(_mm_xor_si128(x[d], x[a]), 8); \
+	x[c] = _mm_add_epi32(x[c], x[d]); \
+	x[b] = chacha_rotate_sse2(_mm_xor_si128(x[b], x[c]), 7)
+
+
+__attribute__((target("sse2")))
+static void chacha20_blocks_sse2(const uint32_t key[8],
+	const uint32_t nonce[3], uint32_t counter, uint8_t* out, size_t count)
+{
+	uint32_t state[16];
+	chacha_setup(state, key, nonce, counter);
+
+	size_t b = 0;
+	for (; b + 4 <= count; b += 4, out += 256) {
+		// Word i of the four blocks is in x[i], block k in lane k
+		__m128i input[16];
+		for (int i = 0; i < 16; i++)
+			input[i] = _mm_set1_epi32(state[i]);
+		input[12] = _mm_add_epi32(input[12], _mm_set_epi32(3, 2, 1, 0));
+
+		__m128i x[16];
+		for (int i = 0; i < 16; i++)
+			x[i] = input[i];
+
+		for (int round = 0; round < 10; round++) {
+			CHACHA_QUARTER_SSE2(x, 0, 4, 8, 12);
+			CHACHA_QUARTER_SSE2(x, 1, 5, 9, 13);
+			CHACHA_QUARTER_SSE2(x, 2, 6, 10, 14);
+			CHACHA_QUARTER_SSE2(x, 3, 7, 11, 15);
+			CHACHA_QUARTER_SSE2(x, 0, 5, 10, 15);
+			CHACHA_QUARTER_SSE2(x, 1, 6, 11, 12);
+			CHACHA_QUARTER_SSE2(x, 2, 7, 8, 13);
+			CHACHA_QUARTER_SSE2(x, 3, 4, 9, 14);
+		}
+
+		uint32_t words[16][4];
+		for (int i = 0; i < 16; i++)
+			_mm_storeu_si128((__m128i*)words[i], _mm_add_epi32(x[i], input[i]));
+		for (int k = 0; k < 4; k++) {
+			for (int i = 0; i < 16; i++)
+				chacha_store32(out + 64 * k + 4 * i, words[i][k]);
+		}
+		state[12] += 4;
+	}
+
+	if (b < count)
+		chacha20_blocks_scalar(key, nonce, state[12], out, count - b);
+}
+#endif
+
+
+#ifdef CHACHA_NEON
+static inline uint32x4_t chacha_rotate_neon(uint32x4_t x, int n)
+{
+	return vorrq_u32(vshlq_u32(x, vdupq_n_s32(n)),
+		vshlq_u32(x, vdupq_n_s32(n - 32)));
+}
+
+
+#define CHACHA_QUARTER_NEON(x, a, b, c, d) \
+	x[a] = vaddq_u32(x[a], x[b]); \
+	x[d] = chacha_rotate_neon(veorq_u32(x[d], x[a]), 16); \
+	x[c] = vaddq_u32(x[c], x[d]); \
+	x[b] = chacha_rotate_neon(veorq_u32(x[b], x[c]), 12); \
+	x[a] = vaddq_u32(x[a], x[b]); \
+	x[d] = chacha_rotate_neon(veorq_u32(x[d], x[a]), 8); \
+	x[c] = vaddq_u32(x[c], x[d]); \
+	x[b] = chacha_rotate_neon(veorq_u32(x[b], x[c]), 7)
+
+
+static void chacha20_blocks_neon(const uint32_t key[8],
+	const uint32_t nonce[3], uint32_t counter, uint8_t* out, size_t count)
+{
+	static const uint32_t kLanes[4] = { 0, 1, 2, 3 };
+
+	uint32_t state[16];
+	chacha_setup(state, key, nonce, counter);
+
+	size_t b = 0;
+	for (; b + 4 <= count; b += 4, out += 256) {
+		uint32x4_t input[16];
+		for (int i = 0; i < 16; i++)
+			input[i] = vdupq_n_u32(state[i]);
+		input[12] = vaddq_u32(input[12], vld1q_u32(kLanes));
+
+		uint32x4_t x[16];
+		for (int i = 0; i < 16; i++)
+			x[i] = input[i];
+
+		for (int round = 0; round < 10; round++) {
+			CHACHA_QUARTER_NEON(x, 0, 4, 8, 12);
+			CHACHA_QUARTER_NEON(x, 1, 5, 9, 13);
+			CHACHA_QUARTER_NEON(x, 2, 6, 10, 14);
+			CHACHA_QUARTER_NEON(x, 3, 7, 11, 15);
+			CHACHA_QUARTER_NEON(x, 0, 5, 10, 15);
+			CHACHA_QUARTER_NEON(x, 1, 6, 11, 12);
+			CHACHA_QUARTER_NEON(x, 2, 7, 8, 13);
+			CHACHA_QUARTER_NEON(x, 3, 4, 9, 14);
+		}
+
+		uint32_t words[16][4];
+		for (int i = 0; i < 16; i++)
+			vst1q_u32(words[i], vaddq_u32(x[i], input[i]));
+		for (int k = 0; k < 4; k++) {
+			for (int i = 0; i < 16; i++)
+				chacha_store32(out + 64 * k + 4 * i, words[i][k]);
+		}
+		state[12] += 4;
+	}
+
+	if (b < count)
+		chacha20_blocks_scalar(key, nonce, state[12], out, count - b);
+}
+#endif
+
+
+/// An implementation of ChaCha20 for a given instruction set.
+struct chacha_kernel {
+	const char* name;
+	chacha_blocks_func blocks;
+	bool available;
+};
+
+
+/// All the implementations built in, best first, and whether the CPU can run
+/// them.
+static const chacha_kernel* chacha_kernels(size_t* count)
+{
+	static const chacha_kernel kernels[] = {
+#ifdef CHACHA_X86
+		{ "sse2", chacha20_blocks_sse2, (bool)__builtin_cpu_supports("sse2") },
+#endif
+#ifdef CHACHA_NEON
+		{ "neon", chacha20_blocks_neon, true },
+#endif
+		{ "scalar", chacha20_blocks_scalar, true },
+	};
+
+	*count = sizeof(kernels) / sizeof(kernels[0]);
+	return kernels;
+}
+
+
+static const chacha_kernel& chacha_select_kernel()
+{
+	size_t count;
+	const chacha_kernel* kernels = chacha_kernels(&count);
+	for (size_t i = 0; i < count; i++) {
+		if (kernels[i].available)
+			return kernels[i];
+	}
+	return kernels[count - 1];
+}
+
+
+/// The best implementation for the running CPU.
+static inline const chacha_kernel& chacha_best_kernel()
+{
+	static const chacha_kernel& best = chacha_select_kernel();
+	return best;
+}
+
+#endif
@@ -0,0 +1,177 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef CIPHERENGINE_H
+#define CIPHERENGINE_H
+
+/// Stream ciphers which can start anywhere in their keystream.
+/// ARC4, the default cipher of hexcrypt, can only go forward, so its
+/// keystream depends on all the records before. These engines are counter
+/// based instead: the keystream for each byte only depends on its absolute
+/// address, so records can be ciphered in any order and on any thread. The
+/// output is not compatible with ARC4.
+
+#include <algorithm>
+#include <memory>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+#include "chacha20.h"
+
+
+class CipherEngine {
+	public:
+		virtual ~CipherEngine() {}
+
+		virtual const char* Name() const = 0;
+		virtual void Apply(uint64_t address, uint8_t* data, size_t length)
+			const = 0;
+			// XOR the data with the keystream for these addresses. This is
+			// symmetric, so it also deciphers.
+
+		static std::unique_ptr<CipherEngine> Create(const char* name,
+			const uint8_t* key, int len);
+			// "aes-ctr" or "chacha20". NULL if the name is unknown or the key
+			// too short.
+};
+
+
+/// AES-128 in counter mode.
+/// The key is the first 16 bytes of the key data, the next 16 are the initial
+/// counter block, zero if missing. Address A uses byte A % 16 of the block
+/// for counter + A / 16, as a 128-bit big endian number.
+class AesCtrEngine: public CipherEngine {
+	public:
+		AesCtrEngine(const uint8_t* key, int len);
+
+		const char* Name() const { return "aes-ctr"; }
+		void Apply(uint64_t address, uint8_t* data, size_t length) const;
+
+		static const int kKeySize = 16;
+
+	private:
+		aes128_key fKey;
+		uint8_t fCounter[16];
+		aes_encrypt_func fEncrypt;
+};
+
+
+/// ChaCha20 as in RFC 8439.
+/// The key is the first 32 bytes of the key data, the next 12 are the nonce,
+/// zero if missing. Address A uses byte A % 64 of block A / 64.
+class ChaCha20Engine: public CipherEngine {
+	public:
+		ChaCha20Engine(const uint8_t* key, int len);
+
+		const char* Name() const { return "chacha20"; }
+		void Apply(uint64_t address, uint8_t* data, size_t length) const;
+
+		static const int kKeySize = 32;
+
+	private:
+		uint32_t fKey[8];
+		uint32_t fNonce[3];
+		chacha_blocks_func fBlocks;
+};
+
+
+std::unique_ptr<CipherEngine> CipherEngine::Create(const char* name,
+	const uint8_t* key, int len)
+{
+	if (strcmp(name, "aes-ctr") == 0 && len >= AesCtrEngine::kKeySize)
+		return std::unique_ptr<CipherEngine>(new AesCtrEngine(key, len));
+	if (strcmp(name, "chacha20") == 0 && len >= ChaCha20Engine::kKeySize)
+		return std::unique_ptr<CipherEngine>(new ChaCha20Engine(key, len));
+	return std::unique_ptr<CipherEngine>();
+}
+
+
+AesCtrEngine::AesCtrEngine(const uint8_t* key, int len)
+	: fEncrypt(aes_best_kernel().encrypt)
+{
+	aes128_expand_key(key, &fKey);
+	memset(fCounter, 0, sizeof(fCounter));
+	if (len > kKeySize)
+		memcpy(fCounter, key + kKeySize, std::min(len - kKeySize, 16));
+}
+
+
+void AesCtrEngine::Apply(uint64_t address, uint8_t* data, size_t length) const
+{
+	uint8_t blocks[64 * 16];
+
+	uint64_t block = address / 16;
+	size_t skip = address % 16;
+	while (length > 0) {
+		size_t count = std::min<size_t>((skip + length + 15) / 16, 64);
+		for (size_t b = 0; b < count; b++) {
+			// Add the block number to the counter, from the last byte
+			uint8_t* counter = blocks + 16 * b;
+			uint64_t add = block + b;
+			unsigned carry = 0;
+			for (int i = 15; i >= 0; i--) {
+				unsigned sum = fCounter[i] + (add & 0xff) + carry;
+				counter[i] = sum;
+				carry = sum >> 8;
+				add >>= 8;
+			}
+		}
+		fEncrypt(&fKey, blocks, blocks, count);
+
+		size_t used = std::min(count * 16 - skip, length);
+		for (size_t i = 0; i < used; i++)
+			data[i] ^= blocks[skip + i];
+
+		data += used;
+		length -= used;
+		block += count;
+		skip = 0;
+	}
+}
+
+
+ChaCha20Engine::ChaCha20Engine(const uint8_t* key, int len)
+	: fBlocks(chacha_best_kernel().blocks)
+{
+	uint8_t nonce[12] = { 0 };
+	if (len > kKeySize)
+		memcpy(nonce, key + kKeySize, std::min(len - kKeySize, 12));
+
+	for (int i = 0; i < 8; i++) {
+		fKey[i] = key[4 * i] | (key[4 * i + 1] << 8) | (key[4 * i + 2] << 16)
+			| ((uint32_t)key[4 * i + 3] << 24);
+	}
+	for (int i = 0; i < 3; i++) {
+		fNonce[i] = nonce[4 * i] | (nonce[4 * i + 1] << 8)
+			| (nonce[4 * i + 2] << 16) | ((uint32_t)nonce[4 * i + 3] << 24);
+	}
+}
+
+
+void ChaCha20Engine::Apply(uint64_t address, uint8_t* data, size_t length)
+	const
+{
+	uint8_t blocks[16 * 64];
+
+	// The block counter is 32 bits, enough for 256 GB of addresses
+	uint64_t block = address / 64;
+	size_t skip = address % 64;
+	while (length > 0) {
+		size_t count = std::min<size_t>((skip + length + 63) / 64, 16);
+		fBlocks(fKey, fNonce, (uint32_t)block, blocks, count);
+
+		size_t used = std::min(count * 64 - skip, length);
+		for (size_t i = 0; i < used; i++)
+			data[i] ^= blocks[skip + i];
+
+		data += used;
+		length -= used;
+		block += count;
+		skip = 0;
+	}
+}
+
+#endif
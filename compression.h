@@ -0,0 +1,492 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+/// Compressed files, read and written through stream buffers so the data
+/// never goes through a temporary file. gzip needs zlib (HEXCRYPT_HAVE_ZLIB),
+/// zstd needs libzstd (HEXCRYPT_HAVE_ZSTD). Both are optional: without them,
+/// such files are reported as unsupported.
+
+#include <algorithm>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+#if HEXCRYPT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+enum Compression {
+	kCompressionNone,
+	kCompressionGzip,
+	kCompressionZstd
+};
+
+
+/// Compression of a file, from its extension: .gz or .zst.
+static Compression compression_of_name(const std::string& filename)
+{
+	size_t dot = filename.rfind('.');
+	if (dot == std::string::npos)
+		return kCompressionNone;
+	std::string extension = filename.substr(dot);
+	if (extension == ".gz")
+		return kCompressionGzip;
+	if (extension == ".zst")
+		return kCompressionZstd;
+	return kCompressionNone;
+}
+
+
+/// Compression of data, from its first bytes.
+static Compression compression_of_data(const uint8_t* data, size_t length)
+{
+	if (length >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+		return kCompressionGzip;
+	if (length >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f
+		&& data[3] == 0xfd)
+		return kCompressionZstd;
+	return kCompressionNone;
+}
+
+
+/// Why a compression can't be used in this build, NULL if it can.
+static const char* compression_unsupported(Compression type)
+{
+#if !HEXCRYPT_HAVE_ZLIB
+	if (type == kCompressionGzip)
+		return "gzip support is not built in";
+#endif
+#if !HEXCRYPT_HAVE_ZSTD
+	if (type == kCompressionZstd)
+		return "zstd support is not built in";
+#endif
+	(void)type;
+	return NULL;
+}
+
+
+/// Stream buffer reading decompressed data from another one.
+/// The compression is found from the first bytes unless given, and data
+/// which isn't compressed is passed as is. Reading stops at the first error,
+/// which is then available from Error().
+class DecompressStreamBuffer: public std::streambuf {
+	public:
+		DecompressStreamBuffer(std::streambuf* source,
+			Compression type = kCompressionNone, bool detect = true,
+			size_t size = 1 << 18);
+		~DecompressStreamBuffer();
+
+		Compression Type();
+		const char* Error() const { return fError; }
+
+	protected:
+		int_type underflow();
+
+	private:
+		bool Start();
+		size_t Refill();
+
+		std::streambuf* fSource;
+		std::vector<char> fInput;
+		std::vector<char> fOutput;
+		size_t fInputStart;
+		size_t fInputEnd;
+		Compression fType;
+		bool fDetect;
+		bool fStarted;
+		bool fMemberEnded;
+			// At the end of a gzip member or zstd frame, more may follow.
+		const char* fError;
+#if HEXCRYPT_HAVE_ZLIB
+		z_stream fZlib;
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+		ZSTD_DStream* fZstd;
+#endif
+};
+
+
+DecompressStreamBuffer::DecompressStreamBuffer(std::streambuf* source,
+	Compression type, bool detect, size_t size)
+	: fSource(source)
+	, fInput(size)
+	, fOutput(size)
+	, fInputStart(0)
+	, fInputEnd(0)
+	, fType(type)
+	, fDetect(detect && type == kCompressionNone)
+	, fStarted(false)
+	, fMemberEnded(false)
+	, fError(NULL)
+{
+#if HEXCRYPT_HAVE_ZSTD
+	fZstd = NULL;
+#endif
+	setg(fOutput.data(), fOutput.data(), fOutput.data());
+}
+
+
+DecompressStreamBuffer::~DecompressStreamBuffer()
+{
+#if HEXCRYPT_HAVE_ZLIB
+	if (fStarted && fType == kCompressionGzip)
+		inflateEnd(&fZlib);
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+	if (fZstd != NULL)
+		ZSTD_freeDStream(fZstd);
+#endif
+}
+
+
+/// The compression of the data, reading its first bytes if needed.
+Compression DecompressStreamBuffer::Type()
+{
+	if (!fStarted)
+		Start();
+	return fType;
+}
+
+
+/// Move the unused input to the start of the buffer and read more after it.
+/// @returns the number of bytes read, 0 at the end of the source.
+size_t DecompressStreamBuffer::Refill()
+{
+	memmove(fInput.data(), fInput.data() + fInputStart,
+		fInputEnd - fInputStart);
+	fInputEnd -= fInputStart;
+	fInputStart = 0;
+
+	std::streamsize got = fSource->sgetn(fInput.data() + fInputEnd,
+		fInput.size() - fInputEnd);
+	if (got <= 0)
+		return 0;
+	fInputEnd += got;
+	return got;
+}
+
+
+bool DecompressStreamBuffer::Start()
+{
+	fStarted = true;
+	if (fDetect) {
+		while (fInputEnd < 4 && Refill() > 0)
+			;
+		fType = compression_of_data((const uint8_t*)fInput.data(), fInputEnd);
+	}
+
+	fError = compression_unsupported(fType);
+	if (fError != NULL)
+		return false;
+
+#if HEXCRYPT_HAVE_ZLIB
+	if (fType == kCompressionGzip) {
+		memset(&fZlib, 0, sizeof(fZlib));
+		// Window of 15 bits, +32 to accept gzip and zlib headers
+		if (inflateInit2(&fZlib, 15 + 32) != Z_OK) {
+			fType = kCompressionNone;
+			fError = "can't start gzip decompression";
+			return false;
+		}
+	}
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+	if (fType == kCompressionZstd) {
+		fZstd = ZSTD_createDStream();
+		if (fZstd == NULL || ZSTD_isError(ZSTD_initDStream(fZstd))) {
+			fError = "can't start zstd decompression";
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+
+DecompressStreamBuffer::int_type DecompressStreamBuffer::underflow()
+{
+	if (!fStarted)
+		Start();
+	if (fError != NULL)
+		return traits_type::eof();
+
+	if (fType == kCompressionNone) {
+		// Data which isn't compressed is read directly in the input buffer
+		if (fInputStart == fInputEnd) {
+			fInputStart = fInputEnd = 0;
+			if (Refill() == 0)
+				return traits_type::eof();
+		}
+		setg(fInput.data() + fInputStart, fInput.data() + fInputStart,
+			fInput.data() + fInputEnd);
+		fInputStart = fInputEnd;
+		return traits_type::to_int_type(*gptr());
+	}
+
+	while (true) {
+		if (fInputStart == fInputEnd && Refill() == 0) {
+			if (!fMemberEnded)
+				fError = "compressed data is truncated";
+			return traits_type::eof();
+		}
+
+		size_t produced = 0;
+#if HEXCRYPT_HAVE_ZLIB
+		if (fType == kCompressionGzip) {
+			// Files made by concatenating gzip files have several members
+			if (fMemberEnded)
+				inflateReset(&fZlib);
+			fZlib.next_in = (Bytef*)fInput.data() + fInputStart;
+			fZlib.avail_in = fInputEnd - fInputStart;
+			fZlib.next_out = (Bytef*)fOutput.data();
+			fZlib.avail_out = fOutput.size();
+			int result = inflate(&fZlib, Z_NO_FLUSH);
+			if (result != Z_OK && result != Z_STREAM_END
+				&& result != Z_BUF_ERROR) {
+				fError = "corrupt gzip data";
+				return traits_type::eof();
+			}
+			fMemberEnded = result == Z_STREAM_END;
+			fInputStart = fInputEnd - fZlib.avail_in;
+			produced = fOutput.size() - fZlib.avail_out;
+		}
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+		if (fType == kCompressionZstd) {
+			ZSTD_inBuffer in = { fInput.data(), fInputEnd, fInputStart };
+			ZSTD_outBuffer out = { fOutput.data(), fOutput.size(), 0 };
+			size_t result = ZSTD_decompressStream(fZstd, &out, &in);
+			if (ZSTD_isError(result)) {
+				fError = "corrupt zstd data";
+				return traits_type::eof();
+			}
+			fMemberEnded = result == 0;
+			fInputStart = in.pos;
+			produced = out.pos;
+		}
+#endif
+
+		if (produced > 0) {
+			setg(fOutput.data(), fOutput.data(), fOutput.data() + produced);
+			return traits_type::to_int_type(*gptr());
+		}
+	}
+}
+
+
+/// Stream buffer compressing data into another one.
+/// Finish must be called, or the buffer destroyed, to end the compressed
+/// stream.
+class CompressStreamBuffer: public std::streambuf {
+	public:
+		CompressStreamBuffer(std::streambuf* sink, Compression type,
+			size_t size = 1 << 18);
+		~CompressStreamBuffer() { Finish(); }
+
+		bool Finish();
+			// Compress what is left and end the stream.
+		const char* Error() const { return fError; }
+
+	protected:
+		int_type overflow(int_type c);
+		int sync();
+
+	private:
+		bool Compress(const char* data, size_t length, bool finish);
+
+		std::streambuf* fSink;
+		std::vector<char> fInput;
+		std::vector<char> fOutput;
+		Compression fType;
+		bool fFinished;
+		const char* fError;
+#if HEXCRYPT_HAVE_ZLIB
+		z_stream fZlib;
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+		ZSTD_CStream* fZstd;
+#endif
+};
+
+
+CompressStreamBuffer::CompressStreamBuffer(std::streambuf* sink,
+	Compression type, size_t size)
+	: fSink(sink)
+	, fInput(size)
+	, fOutput(size)
+	, fType(type)
+	, fFinished(false)
+	, fError(compression_unsupported(type))
+{
+	setp(fInput.data(), fInput.data() + fInput.size());
+
+#if HEXCRYPT_HAVE_ZLIB
+	if (fType == kCompressionGzip) {
+		memset(&fZlib, 0, sizeof(fZlib));
+		// Window of 15 bits, +16 for a gzip header
+		if (deflateInit2(&fZlib, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+			fType = kCompressionNone;
+			fError = "can't start gzip compression";
+		}
+	}
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+	fZstd = NULL;
+	if (fType == kCompressionZstd) {
+		fZstd = ZSTD_createCStream();
+		if (fZstd == NULL || ZSTD_isError(ZSTD_initCStream(fZstd, 3)))
+			fError = "can't start zstd compression";
+	}
+#endif
+}
+
+
+bool CompressStreamBuffer::Finish()
+{
+	if (fFinished)
+		return fError == NULL;
+	fFinished = true;
+
+	if (fError == NULL)
+		Compress(pbase(), pptr() - pbase(), true);
+	setp(fInput.data(), fInput.data() + fInput.size());
+
+#if HEXCRYPT_HAVE_ZLIB
+	if (fType == kCompressionGzip)
+		deflateEnd(&fZlib);
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+	if (fZstd != NULL)
+		ZSTD_freeCStream(fZstd);
+	fZstd = NULL;
+#endif
+	return fError == NULL;
+}
+
+
+CompressStreamBuffer::int_type CompressStreamBuffer::overflow(int_type c)
+{
+	if (sync() != 0)
+		return traits_type::eof();
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+
+/// Compress the buffered data. The compressor keeps what it needs, nothing is
+/// flushed, so calling this often doesn't hurt compression.
+int CompressStreamBuffer::sync()
+{
+	if (fFinished || fError != NULL
+		|| !Compress(pbase(), pptr() - pbase(), false))
+		return -1;
+	setp(fInput.data(), fInput.data() + fInput.size());
+	return 0;
+}
+
+
+bool CompressStreamBuffer::Compress(const char* data, size_t length,
+	bool finish)
+{
+#if HEXCRYPT_HAVE_ZLIB
+	if (fType == kCompressionGzip) {
+		fZlib.next_in = (Bytef*)data;
+		fZlib.avail_in = length;
+		int result;
+		do {
+			fZlib.next_out = (Bytef*)fOutput.data();
+			fZlib.avail_out = fOutput.size();
+			result = deflate(&fZlib, finish ? Z_FINISH : Z_NO_FLUSH);
+			if (result == Z_STREAM_ERROR) {
+				fError = "gzip compression failed";
+				return false;
+			}
+			std::streamsize produced = fOutput.size() - fZlib.avail_out;
+			if (fSink->sputn(fOutput.data(), produced) != produced) {
+				fError = "can't write compressed data";
+				return false;
+			}
+		} while (fZlib.avail_in > 0 || (finish && result != Z_STREAM_END));
+		return true;
+	}
+#endif
+#if HEXCRYPT_HAVE_ZSTD
+	if (fType == kCompressionZstd) {
+		ZSTD_inBuffer in = { data, length, 0 };
+		size_t remaining;
+		do {
+			ZSTD_outBuffer out = { fOutput.data(), fOutput.size(), 0 };
+			remaining = ZSTD_compressStream2(fZstd, &out, &in,
+				finish ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining)) {
+				fError = "zstd compression failed";
+				return false;
+			}
+			if (fSink->sputn(fOutput.data(), out.pos) != (std::streamsize)out.pos) {
+				fError = "can't write compressed data";
+				return false;
+			}
+		} while (in.pos < in.size || (finish && remaining != 0));
+		return true;
+	}
+#endif
+	(void)data;
+	(void)length;
+	(void)finish;
+	fError = "no compression selected";
+	return false;
+}
+
+
+/// Stream buffer over data in memory, to decompress it.
+class MemoryStreamBuffer: public std::streambuf {
+	public:
+		MemoryStreamBuffer(const char* data, size_t length) {
+			char* start = const_cast<char*>(data);
+			setg(start, start, start + length);
+		}
+};
+
+
+/// Decompress data in memory.
+/// @returns false with the reason in error if it fails.
+static bool decompress_buffer(Compression type, const char* data,
+	size_t length, std::vector<char>& output, const char*& error)
+{
+	MemoryStreamBuffer source(data, length);
+	DecompressStreamBuffer decompressor(&source, type, false);
+
+	// Compressed hex is usually about 3 times smaller
+	output.resize(std::max<size_t>(length * 4, 1 << 16));
+	size_t used = 0;
+	while (true) {
+		if (used == output.size())
+			output.resize(output.size() * 2);
+		std::streamsize got = decompressor.sgetn(output.data() + used,
+			output.size() - used);
+		if (got <= 0)
+			break;
+		used += got;
+	}
+	output.resize(used);
+
+	error = decompressor.Error();
+	return error == NULL;
+}
+
+#endif
@@ -0,0 +1,61 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef CRC32_H
+#define CRC32_H
+
+/// CRC-32 as used by zlib, PNG and ethernet (reflected, polynomial 0xEDB88320).
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Tables for slicing by 8: table[0] is the usual one, table[k] gives the CRC
+/// of a byte followed by k zero bytes.
+static const uint32_t (*crc32_table())[256]
+{
+	static uint32_t table[8][256];
+	static bool ready = [] {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[0][i] = c;
+		}
+		for (int k = 1; k < 8; k++) {
+			for (int i = 0; i < 256; i++) {
+				uint32_t c = table[k - 1][i];
+				table[k][i] = (c >> 8) ^ table[0][c & 0xFF];
+			}
+		}
+		return true;
+	}();
+	(void)ready;
+	return table;
+}
+
+
+/// Add data to a running CRC, 8 bytes at a time.
+/// @crc 0 for the first call, then the result of the previous one.
+static inline uint32_t crc32_update(uint32_t crc, const uint8_t* data,
+	size_t length)
+{
+	const uint32_t (*table)[256] = crc32_table();
+	crc = ~crc;
+	for (; length >= 8; length -= 8, data += 8) {
+		uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16)
+			| ((uint32_t)data[3] << 24));
+		uint32_t high = data[4] | (data[5] << 8) | (data[6] << 16)
+			| ((uint32_t)data[7] << 24);
+		crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF]
+			^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+			^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF]
+			^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+	}
+	for (size_t i = 0; i < length; i++)
+		crc = table[0][(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+#endif
@@ -0,0 +1,417 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef HEXCODEC_H
+#define HEXCODEC_H
+
+/// Conversion between ASCII hexadecimal and bytes.
+/// There is a portable table-driven implementation, and SIMD variants for x86
+/// and ARM. The best one for the running CPU is selected at runtime, so the
+/// same binary works everywhere.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define HEXCODEC_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HEXCODEC_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+/// Decode hexadecimal text into bytes.
+/// @text the characters to decode, two per byte.
+/// @count number of bytes to decode (2 * count chars are read).
+/// @out where to store the bytes.
+/// @sum incremented by the sum of all decoded bytes.
+/// @returns the offset of the first invalid char, or -1 if they are all valid.
+typedef long (*hex_decode_func)(const char* text, size_t count, uint8_t* out,
+	uint8_t* sum);
+
+/// Encode bytes into hexadecimal text.
+/// @in the bytes to encode.
+/// @count number of bytes to encode.
+/// @out where to store the text, 2 * count chars are written.
+/// @lowercase use a-f instead of A-F.
+typedef void (*hex_encode_func)(const uint8_t* in, size_t count, char* out,
+	bool lowercase);
+
+
+/// Two-char uppercase text of each byte value.
+static const char kHexPairsUpper[513] =
+	"000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/// Two-char lowercase text of each byte value.
+static const char kHexPairsLower[513] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+
+/// Value of each ASCII char as an hexadecimal digit, 0xFF for non-digits.
+static const uint8_t kHexDigitValue[256] = {
+#define X 0xFF
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+#undef X
+};
+
+
+long hex_decode_scalar(const char* text, size_t count, uint8_t* out,
+	uint8_t* sum)
+{
+	uint8_t total = *sum;
+	for (size_t i = 0; i < count; i++) {
+		uint8_t high = kHexDigitValue[(uint8_t)text[2 * i]];
+		uint8_t low = kHexDigitValue[(uint8_t)text[2 * i + 1]];
+		if ((high | low) & 0xF0) {
+			*sum = total;
+			return high & 0xF0 ? 2 * i : 2 * i + 1;
+		}
+		out[i] = (high << 4) | low;
+		total += out[i];
+	}
+	*sum = total;
+	return -1;
+}
+
+
+void hex_encode_scalar(const uint8_t* in, size_t count, char* out,
+	bool lowercase)
+{
+	const char* pairs = lowercase ? kHexPairsLower : kHexPairsUpper;
+	for (size_t i = 0; i < count; i++) {
+		out[2 * i] = pairs[2 * in[i]];
+		out[2 * i + 1] = pairs[2 * in[i] + 1];
+	}
+}
+
+
+#ifdef HEXCODEC_X86
+/// Convert 16 hex chars to nibble values. Invalid chars are flagged in the
+/// returned mask.
+__attribute__((target("sse2")))
+static inline __m128i hex_nibbles_sse2(__m128i chars, __m128i* invalid)
+{
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i five = _mm_set1_epi8(5);
+
+	__m128i digit = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+	__m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit);
+
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)),
+		_mm_set1_epi8('a'));
+	__m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, five), letter);
+
+	*invalid = _mm_or_si128(*invalid,
+		_mm_andnot_si128(_mm_or_si128(isDigit, isLetter), _mm_set1_epi8(-1)));
+
+	letter = _mm_add_epi8(letter, _mm_set1_epi8(10));
+	return _mm_or_si128(_mm_and_si128(isDigit, digit),
+		_mm_andnot_si128(isDigit, letter));
+}
+
+
+/// Merge pairs of nibbles (high first) into bytes in the low half of each
+/// 16-bit lane.
+__attribute__((target("sse2")))
+static inline __m128i hex_pack_sse2(__m128i nibbles)
+{
+	__m128i high = _mm_and_si128(_mm_slli_epi16(nibbles, 4),
+		_mm_set1_epi16(0x00F0));
+	return _mm_or_si128(high, _mm_srli_epi16(nibbles, 8));
+}
+
+
+__attribute__((target("sse2")))
+long hex_decode_sse2(const char* text, size_t count, uint8_t* out,
+	uint8_t* sum)
+{
+	size_t i = 0;
+	__m128i total = _mm_setzero_si128();
+
+	for (; i + 16 <= count; i += 16) {
+		__m128i invalid = _mm_setzero_si128();
+		__m128i a = hex_nibbles_sse2(
+			_mm_loadu_si128((const __m128i*)(text + 2 * i)), &invalid);
+		__m128i b = hex_nibbles_sse2(
+			_mm_loadu_si128((const __m128i*)(text + 2 * i + 16)), &invalid);
+		if (_mm_movemask_epi8(invalid))
+			break;
+
+		__m128i bytes = _mm_packus_epi16(hex_pack_sse2(a), hex_pack_sse2(b));
+		_mm_storeu_si128((__m128i*)(out + i), bytes);
+		total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+	}
+
+	total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+	*sum += (uint8_t)_mm_cvtsi128_si32(total);
+
+	// Remaining bytes, or the block which contains an error: the scalar
+	// version finds the exact position.
+	long error = hex_decode_scalar(text + 2 * i, count - i, out + i, sum);
+	return error < 0 ? error : error + 2 * i;
+}
+
+
+__attribute__((target("avx2")))
+long hex_decode_avx2(const char* text, size_t count, uint8_t* out,
+	uint8_t* sum)
+{
+	const __m256i nine = _mm256_set1_epi8(9);
+	const __m256i five = _mm256_set1_epi8(5);
+	size_t i = 0;
+	__m256i total = _mm256_setzero_si256();
+
+	for (; i + 32 <= count; i += 32) {
+		__m256i nibbles[2];
+		__m256i invalid = _mm256_setzero_si256();
+		for (int half = 0; half < 2; half++) {
+			__m256i chars = _mm256_loadu_si256(
+				(const __m256i*)(text + 2 * i + 32 * half));
+			__m256i digit = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+			__m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, nine),
+				digit);
+			__m256i letter = _mm256_sub_epi8(
+				_mm256_or_si256(chars, _mm256_set1_epi8(0x20)),
+				_mm256_set1_epi8('a'));
+			__m256i isLetter = _mm256_cmpeq_epi8(
+				_mm256_min_epu8(letter, five), letter);
+			invalid = _mm256_or_si256(invalid, _mm256_andnot_si256(
+				_mm256_or_si256(isDigit, isLetter), _mm256_set1_epi8(-1)));
+			letter = _mm256_add_epi8(letter, _mm256_set1_epi8(10));
+			__m256i value = _mm256_blendv_epi8(letter, digit, isDigit);
+			nibbles[half] = _mm256_or_si256(
+				_mm256_and_si256(_mm256_slli_epi16(value, 4),
+					_mm256_set1_epi16(0x00F0)),
+				_mm256_srli_epi16(value, 8));
+		}
+		if (_mm256_movemask_epi8(invalid))
+			break;
+
+		// packus works within 128-bit lanes, restore the byte order.
+		__m256i bytes = _mm256_permute4x64_epi64(
+			_mm256_packus_epi16(nibbles[0], nibbles[1]), 0xD8);
+		_mm256_storeu_si256((__m256i*)(out + i), bytes);
+		total = _mm256_add_epi64(total,
+			_mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+	}
+
+	__m128i half = _mm_add_epi64(_mm256_castsi256_si128(total),
+		_mm256_extracti128_si256(total, 1));
+	half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+	*sum += (uint8_t)_mm_cvtsi128_si32(half);
+
+	long error = hex_decode_sse2(text + 2 * i, count - i, out + i, sum);
+	return error < 0 ? error : error + 2 * i;
+}
+
+
+__attribute__((target("ssse3")))
+void hex_encode_ssse3(const uint8_t* in, size_t count, char* out,
+	bool lowercase)
+{
+	const __m128i digits = _mm_loadu_si128((const __m128i*)(lowercase
+		? "0123456789abcdef" : "0123456789ABCDEF"));
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i high = _mm_shuffle_epi8(digits,
+			_mm_and_si128(_mm_srli_epi16(bytes, 4), mask));
+		__m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, mask));
+		_mm_storeu_si128((__m128i*)(out + 2 * i), _mm_unpacklo_epi8(high, low));
+		_mm_storeu_si128((__m128i*)(out + 2 * i + 16),
+			_mm_unpackhi_epi8(high, low));
+	}
+
+	hex_encode_scalar(in + i, count - i, out + 2 * i, lowercase);
+}
+
+
+__attribute__((target("avx2")))
+void hex_encode_avx2(const uint8_t* in, size_t count, char* out,
+	bool lowercase)
+{
+	const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+		(const __m128i*)(lowercase ? "0123456789abcdef" : "0123456789ABCDEF")));
+	const __m256i mask = _mm256_set1_epi16(0x0F);
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		// One byte per 16-bit lane, then put the high nibble in the first
+		// char and the low nibble in the second one, in memory order.
+		__m256i words = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i*)(in + i)));
+		__m256i nibbles = _mm256_or_si256(
+			_mm256_and_si256(_mm256_srli_epi16(words, 4), mask),
+			_mm256_slli_epi16(_mm256_and_si256(words, mask), 8));
+		_mm256_storeu_si256((__m256i*)(out + 2 * i),
+			_mm256_shuffle_epi8(digits, nibbles));
+	}
+
+	hex_encode_scalar(in + i, count - i, out + 2 * i, lowercase);
+}
+#endif
+
+
+#ifdef HEXCODEC_NEON
+long hex_decode_neon(const char* text, size_t count, uint8_t* out,
+	uint8_t* sum)
+{
+	size_t i = 0;
+	uint32_t total = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		// Load the 32 chars, deinterleaving high and low nibbles
+		uint8x16x2_t chars = vld2q_u8((const uint8_t*)text + 2 * i);
+		uint8x16_t value[2];
+		uint8x16_t invalid = vdupq_n_u8(0);
+		for (int n = 0; n < 2; n++) {
+			uint8x16_t digit = vsubq_u8(chars.val[n], vdupq_n_u8('0'));
+			uint8x16_t isDigit = vcleq_u8(digit, vdupq_n_u8(9));
+			uint8x16_t letter = vsubq_u8(vorrq_u8(chars.val[n],
+				vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+			uint8x16_t isLetter = vcleq_u8(letter, vdupq_n_u8(5));
+			invalid = vorrq_u8(invalid, vmvnq_u8(vorrq_u8(isDigit, isLetter)));
+			value[n] = vbslq_u8(isDigit, digit,
+				vaddq_u8(letter, vdupq_n_u8(10)));
+		}
+		if (vmaxvq_u8(invalid))
+			break;
+
+		uint8x16_t bytes = vorrq_u8(vshlq_n_u8(value[0], 4), value[1]);
+		vst1q_u8(out + i, bytes);
+		total += vaddlvq_u8(bytes);
+	}
+
+	*sum += (uint8_t)total;
+
+	long error = hex_decode_scalar(text + 2 * i, count - i, out + i, sum);
+	return error < 0 ? error : error + 2 * i;
+}
+
+
+void hex_encode_neon(const uint8_t* in, size_t count, char* out,
+	bool lowercase)
+{
+	const uint8x16_t digits = vld1q_u8((const uint8_t*)(lowercase
+		? "0123456789abcdef" : "0123456789ABCDEF"));
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t bytes = vld1q_u8(in + i);
+		uint8x16x2_t chars;
+		chars.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(bytes, 4));
+		chars.val[1] = vqtbl1q_u8(digits, vandq_u8(bytes, vdupq_n_u8(0x0F)));
+		// Store interleaving high and low nibble chars
+		vst2q_u8((uint8_t*)out + 2 * i, chars);
+	}
+
+	hex_encode_scalar(in + i, count - i, out + 2 * i, lowercase);
+}
+#endif
+
+
+/// An implementation of the conversions for a given instruction set.
+struct hex_kernel {
+	const char* name;
+	hex_decode_func decode;
+	hex_encode_func encode;
+	bool available;
+};
+
+
+/// All the implementations built in, best first, and whether the CPU can run
+/// them.
+static const hex_kernel* hex_kernels(size_t* count)
+{
+	static const hex_kernel kernels[] = {
+#ifdef HEXCODEC_X86
+		{ "avx2", hex_decode_avx2, hex_encode_avx2,
+			(bool)__builtin_cpu_supports("avx2") },
+		{ "ssse3", hex_decode_sse2, hex_encode_ssse3,
+			(bool)__builtin_cpu_supports("ssse3") },
+		{ "sse2", hex_decode_sse2, hex_encode_scalar,
+			(bool)__builtin_cpu_supports("sse2") },
+#endif
+#ifdef HEXCODEC_NEON
+		{ "neon", hex_decode_neon, hex_encode_neon, true },
+#endif
+		{ "scalar", hex_decode_scalar, hex_encode_scalar, true },
+	};
+
+	*count = sizeof(kernels) / sizeof(kernels[0]);
+	return kernels;
+}
+
+
+static const hex_kernel& hex_select_kernel()
+{
+	size_t count;
+	const hex_kernel* kernels = hex_kernels(&count);
+	for (size_t i = 0; i < count; i++) {
+		if (kernels[i].available)
+			return kernels[i];
+	}
+	return kernels[count - 1];
+}
+
+
+/// The best implementation for the running CPU.
+static inline const hex_kernel& hex_best_kernel()
+{
+	static const hex_kernel& best = hex_select_kernel();
+	return best;
+}
+
+
+/// Decode hexadecimal text using the best implementation for this CPU.
+/// See hex_decode_func for the parameters.
+static inline long hex_decode(const char* text, size_t count, uint8_t* out,
+	uint8_t* sum)
+{
+	return hex_best_kernel().decode(text, count, out, sum);
+}
+
+
+/// Encode bytes to hexadecimal text using the best implementation for this
+/// CPU. See hex_encode_func for the parameters.
+static inline void hex_encode(const uint8_t* in, size_t count, char* out,
+	bool lowercase)
+{
+	hex_best_kernel().encode(in, count, out, lowercase);
+}
+
+#endif
@@ -1,39 +1,885 @@
 #include "ihex.h"
+#include "hexserver.h"
 
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+
+
+/// One input and output file pair to process.
+struct Job {
+	std::string input;
+	std::string output;
+};
+
+
+/// Read a list of "input output" file name pairs, one per line.
+/// Empty lines and lines starting with # are ignored.
+static bool ReadJobList(const char* filename, std::vector<Job>& jobs)
+{
+	std::ifstream list(filename);
+	if (!list.is_open())
+		return false;
+
+	std::string line;
+	while (std::getline(list, line)) {
+		std::istringstream fields(line);
+		Job job;
+		if (!(fields >> job.input) || job.input[0] == '#')
+			continue;
+		if (!(fields >> job.output)) {
+			std::cerr << filename << ": no output file for " << job.input << "\n";
+			return false;
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+
+enum FileFormat {
+	kAutomatic,
+	kHex,
+	kBinary,
+	kContainer
+};
+
+
+/// Guess the format of a file from its extension: .bin for raw binary, .hxc
+/// for the packed container, Intel hex for anything else. A compression
+/// extension after it is skipped.
+static FileFormat FormatOf(std::string filename)
+{
+	if (compression_of_name(filename) != kCompressionNone)
+		filename.resize(filename.rfind('.'));
+
+	size_t dot = filename.rfind('.');
+	if (dot == std::string::npos)
+		return kHex;
+	std::string extension = filename.substr(dot);
+	if (extension == ".bin")
+		return kBinary;
+	if (extension == ".hxc")
+		return kContainer;
+	return kHex;
+}
+
+
+/// Options applying to all files.
+struct Options {
+	Options()
+		: stream(false)
+		, repack(0)
+		, output(kAutomatic)
+		, base(0)
+		, threads(1)
+		, allErrors(false)
+		, previous(NULL)
+		, engine(NULL)
+		, digests(false)
+		, cache(NULL)
+	{
+	}
+
+	bool stream;
+	int repack;
+	HexFormat format;
+	FileFormat output;
+		// Format of the output files, from their name if automatic.
+	uint32_t base;
+		// Address of the first byte of binary input files.
+	unsigned threads;
+		// Threads used to process one file.
+	bool allErrors;
+		// Report all the parse errors in a file, not just the first.
+	const IntelHex* previous;
+		// Previous plain and ciphered version, to reuse the keystream.
+	std::vector<AddressRange> ranges;
+		// Only cipher these addresses, if not empty.
+	const CipherEngine* engine;
+		// Counter based cipher to use instead of ARC4, if not NULL.
+	bool digests;
+		// Write the digests of each output file next to it.
+	const char* cache;
+		// Directory of the parsed image cache, if not NULL.
+};
+
+
+/// Parse an address range given as "start-end", in hexadecimal.
+static bool ParseRange(const char* text, AddressRange& range)
+{
+	char* end;
+	range.start = strtoull(text, &end, 16);
+	if (end == text || *end != '-')
+		return false;
+
+	text = end + 1;
+	range.end = strtoull(text, &end, 16);
+	return end != text && *end == '\0' && range.end > range.start;
+}
+
+
+/// Read an input file, in the format given by its name.
+static bool Load(IntelHex& file, const std::string& name,
+	const Options& options)
+{
+	file.SetCache(options.cache);
+	switch (FormatOf(name)) {
+		case kBinary:
+			return file.ReadBinary(name.c_str(), options.base);
+		case kContainer:
+			return file.ReadContainer(name.c_str());
+		default:
+			break;
+	}
+
+	if (!options.allErrors)
+		return file.Read(name.c_str());
+
+	std::vector<ParseFailure> failures;
+	bool result = file.Read(name.c_str(), failures, true);
+	std::ostringstream errors;
+	for (const ParseFailure& failure: failures) {
+		errors << name << ":" << failure.line << ":" << failure.column << ": "
+			<< failure.Reason() << "\n";
+	}
+	std::cerr << errors.str();
+	return result;
+}
+
+
+/// Write an output file in the given format.
+static bool Save(IntelHex& file, const std::string& name, FileFormat format)
+{
+	switch (format) {
+		case kBinary:
+			return file.WriteBinary(name.c_str());
+		case kContainer:
+			return file.WriteContainer(name.c_str());
+		default:
+			return file.Write(name.c_str());
+	}
+}
+
+
+/// Write the digests computed while saving a file to name.digests, or to the
+/// standard error for the standard output.
+static bool SaveDigests(const IntelHex& file, const std::string& name)
+{
+	if (IsStandardStream(name.c_str())) {
+		file.Digests().Print(std::cerr);
+		return true;
+	}
+
+	std::ofstream sidecar((name + ".digests").c_str());
+	file.Digests().Print(sidecar);
+	sidecar.close();
+	if (!sidecar) {
+		std::cerr << name << ".digests: can't write digests\n";
+		return false;
+	}
+	return true;
+}
+
+
+static bool Process(const Job& job, const CipherContext& context,
+	const Options& options, HexStats& stats)
+{
+	FileFormat output = options.output;
+	if (output == kAutomatic)
+		output = FormatOf(job.output);
+
+	// Only Intel hex files can be streamed, others are loaded in memory
+	if (options.stream && FormatOf(job.input) == kHex && output == kHex)
+		return IntelHex::Stream(job.input.c_str(), job.output.c_str(), context,
+			options.format, &stats);
+
+	if (options.digests && output != kHex) {
+		std::cerr << job.output << ": digests are only computed for Intel hex "
+			"files\n";
+		return false;
+	}
+
+	IntelHex file;
+	file.SetFormat(options.format);
+	file.SetThreads(options.threads);
+	file.SetDigests(options.digests);
+	bool result = Load(file, job.input, options);
+
+	if (result) {
+		file.Repack(options.repack);
+		if (options.engine != NULL)
+			file.Cipher(*options.engine);
+		else if (!options.ranges.empty())
+			file.Cipher(context, options.ranges);
+		else if (options.previous != NULL)
+			file.Cipher(context, options.previous[0], options.previous[1]);
+		else
+			file.Cipher(context);
+
+		result = Save(file, job.output, output);
+		if (result && options.digests)
+			result = SaveDigests(file, job.output);
+	}
+	stats += file.Stats();
+	return result;
+}
+
+
+/// Cipher one input file with many keys, parsing it only once.
+/// The keys are handled in batches, so only a few copies of the data are in
+/// memory at once.
+/// @keys the key and output file pairs.
+/// @returns the number of outputs which failed.
+static int ProcessKeys(const char* input, const std::vector<Job>& keys,
+	const Options& options, HexStats& stats)
+{
+	IntelHex file;
+	file.SetFormat(options.format);
+	file.SetThreads(options.threads);
+	if (!Load(file, input, options))
+		return keys.size();
+	file.Repack(options.repack);
+
+	std::atomic<int> failed(0);
+	std::mutex outputLock;
+	// Key lists often name the same key file for several outputs
+	CipherContextCache cache;
+	size_t batch = 16 * options.threads;
+	for (size_t first = 0; first < keys.size(); first += batch) {
+		size_t last = std::min(first + batch, keys.size());
+
+		std::vector<CipherContext> contexts;
+		std::vector<const Job*> outputs;
+		contexts.reserve(last - first);
+		for (size_t i = first; i < last; i++) {
+			uint8_t key[256];
+			int size = CipherContext::ReadKey(keys[i].input.c_str(), key);
+			if (size <= 0) {
+				std::cerr << keys[i].input << ": can't read key\n";
+				failed++;
+				continue;
+			}
+			contexts.push_back(cache.Get(key, size));
+			outputs.push_back(&keys[i]);
+		}
+
+		std::vector<const CipherContext*> pointers;
+		for (const CipherContext& context: contexts)
+			pointers.push_back(&context);
+		std::vector<IntelHex> copies;
+		file.CipherCopies(pointers, copies);
+
+		run_parallel(options.threads, copies.size(), [&](size_t i, size_t) {
+			FileFormat output = options.output;
+			if (output == kAutomatic)
+				output = FormatOf(outputs[i]->output);
+			bool saved;
+			if (options.digests && output != kHex) {
+				std::lock_guard<std::mutex> lock(outputLock);
+				std::cerr << outputs[i]->output << ": digests are only computed "
+					"for Intel hex files\n";
+				saved = false;
+			} else {
+				copies[i].SetDigests(options.digests);
+				saved = Save(copies[i], outputs[i]->output, output)
+					&& (!options.digests
+						|| SaveDigests(copies[i], outputs[i]->output));
+			}
+			if (!saved) {
+				failed++;
+				std::lock_guard<std::mutex> lock(outputLock);
+				std::cerr << outputs[i]->output << ": failed\n";
+			}
+		});
+
+		for (const IntelHex& copy: copies)
+			stats += copy.Stats();
+	}
+
+	stats += file.Stats();
+	return failed;
+}
+
+
+static void PrintStats(const HexStats& stats)
+{
+	std::ostringstream out;
+	out.setf(std::ios::fixed);
+	out.precision(3);
+	out << "phase     time (ms)\n"
+		<< "read    " << std::setw(11) << stats.readTime * 1000 << "\n"
+		<< "cipher  " << std::setw(11) << stats.cipherTime * 1000 << "\n"
+		<< "write   " << std::setw(11) << stats.writeTime * 1000 << "\n"
+		<< "lines:          " << stats.lines << "\n"
+		<< "data records:   " << stats.dataRecords << "\n"
+		<< "bytes ciphered: " << stats.bytesCiphered << "\n"
+		<< "bytes written:  " << stats.bytesWritten << "\n"
+		<< "allocations:    " << stats.allocations << "\n";
+#if !HEXCRYPT_STATS
+	out << "(statistics are disabled in this build)\n";
+#endif
+	std::cerr << out.str();
+}
+
+
+/// Process all the jobs on a pool of threads, one per core.
+/// A failed job is reported and does not stop the other ones.
+/// @returns the number of jobs which failed.
+/// @stats the statistics of all jobs are added there.
+static int ProcessAll(const std::vector<Job>& jobs,
+	const CipherContext& context, const Options& options, HexStats& stats)
+{
+	std::atomic<size_t> next(0);
+	std::atomic<int> failed(0);
+	std::mutex outputLock;
+
+	auto worker = [&]() {
+		HexStats local;
+		for (size_t i = next++; i < jobs.size(); i = next++) {
+			if (!Process(jobs[i], context, options, local)) {
+				failed++;
+				std::lock_guard<std::mutex> lock(outputLock);
+				std::cerr << jobs[i].input << ": failed\n";
+			}
+		}
+		std::lock_guard<std::mutex> lock(outputLock);
+		stats += local;
+	};
+
+	size_t count = std::thread::hardware_concurrency();
+	if (count == 0)
+		count = 1;
+	if (count > jobs.size())
+		count = jobs.size();
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < count; i++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (auto& thread: threads)
+		thread.join();
+
+	return failed;
+}
+
+
+/// Write the records of updated which changed since old, to output.
+static bool MakePatch(const char* old, const char* updated, const char* output,
+	const Options& options, HexStats& stats)
+{
+	IntelHex oldFile;
+	IntelHex updatedFile;
+	if (!Load(oldFile, old, options) || !Load(updatedFile, updated, options))
+		return false;
+
+	FileFormat format = options.output;
+	if (format == kAutomatic)
+		format = FormatOf(output);
+	if (options.digests && format != kHex) {
+		std::cerr << output << ": digests are only computed for Intel hex "
+			"files\n";
+		return false;
+	}
+
+	IntelHex patch;
+	patch.SetFormat(options.format);
+	patch.SetThreads(options.threads);
+	patch.SetDigests(options.digests);
+	patch.Patch(oldFile, updatedFile);
+	bool result = Save(patch, output, format)
+		&& (!options.digests || SaveDigests(patch, output));
+	stats += oldFile.Stats();
+	stats += updatedFile.Stats();
+	stats += patch.Stats();
+	return result;
+}
+
+
+#ifdef HEXCRYPT_USE_MMAP
+static HexServer* sServer;
+
+
+static void StopServer(int)
+{
+	sServer->Stop();
+}
+
+
+/// Serve requests with the keys given as "name=keyfile", or just "keyfile" to
+/// use the file name as key name.
+static int Serve(const char* path, int count, char* keys[], unsigned threads)
+{
+	HexServer server;
+	for (int i = 0; i < count; i++) {
+		const char* equal = strchr(keys[i], '=');
+		std::string name = keys[i];
+		const char* file = keys[i];
+		if (equal != NULL) {
+			name.resize(equal - keys[i]);
+			file = equal + 1;
+		}
+		if (!server.AddKey(name, file)) {
+			std::cerr << keys[i] << ": can't read key\n";
+			return -2;
+		}
+	}
+
+	if (!server.Listen(path)) {
+		std::cerr << "Can't listen on " << path << ": " << strerror(errno)
+			<< "\n";
+		return -1;
+	}
+
+	sServer = &server;
+	signal(SIGINT, StopServer);
+	signal(SIGTERM, StopServer);
+	server.Run(threads);
+	return 0;
+}
+
+
+/// Have a server cipher a file, streaming it when it is the standard input or
+/// output.
+static int Forward(const char* path, const char* input, const char* key,
+	const char* output, const HexFormat& format)
+{
+	std::string error;
+	bool result;
+	if (!IsStandardStream(input) && !IsStandardStream(output))
+		result = HexServer::Request(path, key, format, input, output, error);
+	else {
+		FileStreamBuffer inBuffer(STDIN_FILENO);
+		FileStreamBuffer outBuffer(STDOUT_FILENO);
+		std::ifstream inFile;
+		std::ofstream outFile;
+		std::istream in(&inBuffer);
+		std::ostream out(&outBuffer);
+		if (!IsStandardStream(input)) {
+			inFile.open(input, std::ios::binary);
+			in.rdbuf(inFile.rdbuf());
+		}
+		if (!IsStandardStream(output)) {
+			outFile.open(output, std::ios::binary);
+			out.rdbuf(outFile.rdbuf());
+		}
+		if (!inFile.is_open() && !IsStandardStream(input))
+			error = "Can't read input file";
+		else if (!outFile.is_open() && !IsStandardStream(output))
+			error = "Can't write output file";
+		result = error.empty()
+			&& HexServer::Request(path, key, format, in, out, error);
+	}
+
+	if (!result) {
+		std::cerr << error << "\n";
+		return -3;
+	}
+	return 0;
+}
+#endif
+
 
 int main(int argc, char* argv[])
 {
-	if (argc != 4)
+	const char* name = argv[0];
+	bool batch = false;
+	bool keys = false;
+	bool verify = false;
+	bool patch = false;
+	bool stats = false;
+	int threads = 0;
+	const char* previous[2] = { NULL, NULL };
+	const char* cipher = "arc4";
+	const char* serve = NULL;
+	const char* server = NULL;
+	Options options;
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--stream") == 0)
+			options.stream = true;
+		else if (strcmp(argv[1], "--batch") == 0)
+			batch = true;
+		else if (strcmp(argv[1], "--keys") == 0)
+			keys = true;
+		else if (strcmp(argv[1], "--verify") == 0)
+			verify = true;
+		else if (strcmp(argv[1], "--patch") == 0)
+			patch = true;
+		else if (strcmp(argv[1], "--stats") == 0)
+			stats = true;
+		else if (strcmp(argv[1], "--lowercase") == 0)
+			options.format.lowercase = true;
+		else if (strcmp(argv[1], "--digests") == 0)
+			options.digests = true;
+		else if (strcmp(argv[1], "--all-errors") == 0)
+			options.allErrors = true;
+		else if (strcmp(argv[1], "--lf") == 0)
+			options.format.crlf = false;
+		else if (strcmp(argv[1], "--repack") == 0 && argc > 2) {
+			options.repack = atoi(argv[2]);
+			if (options.repack < 1 || options.repack > 255) {
+				std::cerr << "Record length must be between 1 and 255.\n";
+				exit(-1);
+			}
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--format") == 0 && argc > 2) {
+			if (strcmp(argv[2], "hex") == 0)
+				options.output = kHex;
+			else if (strcmp(argv[2], "bin") == 0)
+				options.output = kBinary;
+			else if (strcmp(argv[2], "hxc") == 0)
+				options.output = kContainer;
+			else {
+				std::cerr << "Unknown output format " << argv[2] << ".\n";
+				exit(-1);
+			}
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--base") == 0 && argc > 2) {
+			options.base = strtoul(argv[2], NULL, 16);
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+			options.cache = argv[2];
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+			threads = atoi(argv[2]);
+			if (threads < 1) {
+				std::cerr << "Thread count must be at least 1.\n";
+				exit(-1);
+			}
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--incremental") == 0 && argc > 3) {
+			previous[0] = argv[2];
+			previous[1] = argv[3];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(argv[1], "--serve") == 0 && argc > 2) {
+			serve = argv[2];
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--connect") == 0 && argc > 2) {
+			server = argv[2];
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--cipher") == 0 && argc > 2) {
+			cipher = argv[2];
+			if (strcmp(cipher, "arc4") != 0 && strcmp(cipher, "aes-ctr") != 0
+					&& strcmp(cipher, "chacha20") != 0) {
+				std::cerr << "Unknown cipher " << cipher << ".\n";
+				exit(-1);
+			}
+			argc--;
+			argv++;
+		} else if (strcmp(argv[1], "--range") == 0 && argc > 2) {
+			AddressRange range;
+			if (!ParseRange(argv[2], range)) {
+				std::cerr << "Invalid address range " << argv[2] << ".\n";
+				exit(-1);
+			}
+			options.ranges.push_back(range);
+			argc--;
+			argv++;
+		} else
+			break;
+		argc--;
+		argv++;
+	}
+
+	if (options.stream && options.repack != 0) {
+		std::cerr << "--repack can't be used with --stream.\n";
+		exit(-1);
+	}
+
+	if (options.digests && (options.stream || serve != NULL
+			|| server != NULL)) {
+		std::cerr << "--digests can't be used with --stream, --serve or "
+			"--connect.\n";
+		exit(-1);
+	}
+
+	if (options.stream && !options.ranges.empty()) {
+		std::cerr << "--range can't be used with --stream.\n";
+		exit(-1);
+	}
+
+	if (previous[0] != NULL && (options.stream || !options.ranges.empty())) {
+		std::cerr << "--incremental can't be used with --stream or --range.\n";
+		exit(-1);
+	}
+
+	if (options.stream && options.output != kAutomatic
+			&& options.output != kHex) {
+		std::cerr << "--stream only writes Intel hex files.\n";
+		exit(-1);
+	}
+
+	if (verify && (batch || keys)) {
+		std::cerr << "--verify can't be used with --batch or --keys.\n";
+		exit(-1);
+	}
+
+	if (keys && (batch || options.stream || previous[0] != NULL
+			|| !options.ranges.empty())) {
+		std::cerr << "--keys can't be used with --batch, --stream, "
+			"--incremental or --range.\n";
+		exit(-1);
+	}
+
+	if (strcmp(cipher, "arc4") != 0 && (options.stream || verify || keys
+			|| previous[0] != NULL || !options.ranges.empty())) {
+		std::cerr << "--cipher " << cipher << " can't be used with --stream, "
+			"--verify, --keys, --incremental or --range.\n";
+		exit(-1);
+	}
+
+	if ((serve != NULL || server != NULL) && (batch || keys || verify
+			|| previous[0] != NULL || !options.ranges.empty()
+			|| options.repack != 0 || options.output != kAutomatic
+			|| strcmp(cipher, "arc4") != 0)) {
+		std::cerr << "--serve and --connect only stream Intel hex files with "
+			"ARC4.\n";
+		exit(-1);
+	}
+
+	if (patch && (verify || batch || keys || options.stream || serve != NULL
+			|| server != NULL || previous[0] != NULL || !options.ranges.empty()
+			|| options.repack != 0 || strcmp(cipher, "arc4") != 0)) {
+		std::cerr << "--patch can't be used with --verify, --batch, --keys, "
+			"--stream, --serve, --connect, --incremental, --range, --repack "
+			"or --cipher.\n";
+		exit(-1);
+	}
+
+#ifdef HEXCRYPT_USE_MMAP
+	if (serve != NULL && argc > 1) {
+		return Serve(serve, argc - 1, argv + 1, threads > 0 ? threads
+			: std::max(1u, std::thread::hardware_concurrency()));
+	}
+	if (server != NULL && argc == 4)
+		return Forward(server, argv[1], argv[2], argv[3], options.format);
+#else
+	if (serve != NULL || server != NULL) {
+		std::cerr << "--serve and --connect need Unix sockets.\n";
+		exit(-1);
+	}
+#endif
+
+	bool usage;
+	if (batch || keys) {
+		// Either a list file, or input and output pairs after the key
+		usage = argc < 3 || (argc > 3 && argc % 2 != 0);
+	} else
+		usage = argc != 4;
+
+	if (usage)
 	{
-		std::cerr << argv[0] << " input.hex keyfile output.hex\n"
+		std::cerr << name << " [options] input.hex keyfile output.hex\n"
+			<< name << " [options] --batch keyfile list.txt\n"
+			<< name << " [options] --batch keyfile input.hex output.hex...\n"
+			<< name << " [options] --keys input.hex list.txt\n"
+			<< name << " [options] --keys input.hex keyfile output.hex...\n"
+			<< name << " --verify plain.hex keyfile ciphered.hex\n"
+			<< name << " [options] --patch old.hex new.hex patch.hex\n"
+			<< name << " [--threads N] --serve socket [name=]keyfile...\n"
+			<< name << " [options] --connect socket input.hex name output.hex\n"
 			"Encrypts or decrypts the data in an Intel Hex file.\n"
-			"Addresses are unchanged, but checksum is updated.\n\n"
-			"The [keyfile] is a raw binary file with the key data. The whole file is\n"
-			"used as key data, and can be of arbitrary size.\n"
+			"Addresses are unchanged, but checksum is updated.\n"
+			"Use - as input or output file for the standard input or output.\n\n"
+			"The [keyfile] is a raw binary file with the key data. It can be of\n"
+			"arbitrary size, but ARC4 only uses the first 256 bytes.\n\n"
+			"With --cipher, AES-128 in counter mode or ChaCha20 are used instead.\n"
+			"Their keystream depends on the absolute address of each byte, so\n"
+			"the output differs from ARC4. aes-ctr takes a 16-byte key and an\n"
+			"optional 16-byte initial counter after it, chacha20 a 32-byte key\n"
+			"and an optional 12-byte nonce after it.\n\n"
+			"With --batch, many files are processed in parallel with the same key.\n"
+			"They are given as input and output pairs, or listed in a text file\n"
+			"with one \"input.hex output.hex\" pair per line.\n\n"
+			"With --verify, nothing is written: the ciphered file is deciphered as\n"
+			"it is read, and compared with the plain one record by record. The\n"
+			"first difference is reported, and the exit code is -4 if there is one.\n\n"
+			"With --patch, no key is needed: the records of new.hex with data which\n"
+			"differs from old.hex, or isn't there, are written to patch.hex as they\n"
+			"are. Both are usually ciphered with the same key. With --format hxc,\n"
+			"the patch is written as packed segments.\n\n"
+			"With --keys, one file is parsed once and ciphered with many keys, each\n"
+			"written to its own output. They are given as keyfile and output pairs,\n"
+			"or listed in a text file with one \"keyfile output.hex\" pair per line.\n\n"
+			"With --serve, hexcrypt stays in memory with the keys loaded, and\n"
+			"streams files for clients connecting to the Unix socket, on N\n"
+			"threads. Keys are named by their file name, or the given name.\n"
+			"--connect sends a request to such a server instead of reading the\n"
+			"key, which is given by name. Relative file names are sent as\n"
+			"absolute ones, \"-\" is sent through the socket. The output is the\n"
+			"same as with --stream. The server opens the files of requests with\n"
+			"its own rights, so anyone able to connect is trusted with them: the\n"
+			"socket is only open to the user running the server, and a socket\n"
+			"of a server still running is not replaced.\n\n"
+			"Options:\n"
+			"  --stream     cipher and write records as they are read, without\n"
+			"               loading the whole file in memory.\n"
+			"  --lowercase  write hexadecimal digits in lowercase.\n"
+			"  --lf         end lines with LF instead of CR LF.\n"
+			"  --repack N   merge contiguous data records and split them in\n"
+			"               records of N bytes (1 to 255) before ciphering.\n"
+			"  --format F   write files as F: hex (Intel hex), bin (raw binary\n"
+			"               image) or hxc (packed segments). By default, .bin\n"
+			"               and .hxc files are binary and packed, others hex.\n"
+			"               Input files are always guessed from their name.\n"
+			"  --base A     load .bin input files at address A, in hexadecimal.\n"
+			"  --threads N  cipher and write each file with N threads. By default,\n"
+			"               all cores are used for a single file, and one per\n"
+			"               file with --batch.\n"
+			"  --incremental PLAIN CIPHERED\n"
+			"               reuse the keystream of a previous version of the\n"
+			"               file, given before and after ciphering with the\n"
+			"               same key. Records are only ciphered again from the\n"
+			"               first one with a different size.\n"
+			"  --range S-E  only cipher the data from absolute address S to E\n"
+			"               (excluded), in hexadecimal. Can be repeated.\n"
+			"  --cipher C   cipher with C: arc4 (the default), aes-ctr or chacha20.\n"
+			"  --all-errors report all the errors in an input file, one per line,\n"
+			"               instead of stopping at the first one.\n"
+			"  --digests    write the SHA-256 and CRC-32 of each output file, and\n"
+			"               of its data, to output.hex.digests. They are\n"
+			"               computed while writing. For the standard output, they\n"
+			"               are printed on the standard error.\n"
+			"  --cache DIR  keep the parsed Intel hex input files in DIR, and\n"
+			"               load them from there instead of parsing them again\n"
+			"               while their size, time and contents are the same.\n"
+			"  --stats      print the time spent reading, ciphering and writing,\n"
+			"               and what was processed. With --stream, all the time\n"
+			"               is counted as read time. With --batch, the numbers\n"
+			"               are the sum for all files.\n"
 			;
 		exit(-1);
 	}
 
-	IntelHex file;
+	if (keys) {
+		std::vector<Job> outputs;
+		if (argc == 3) {
+			if (!ReadJobList(argv[2], outputs)) {
+				std::cerr << "Error reading key list.\n";
+				exit(-1);
+			}
+		} else {
+			for (int i = 2; i < argc; i += 2) {
+				Job job = { argv[i], argv[i + 1] };
+				outputs.push_back(job);
+			}
+		}
 
-	file.Read(argv[1]);
+		options.threads = threads > 0 ? threads
+			: std::max(1u, std::thread::hardware_concurrency());
+		HexStats totals;
+		int failed = ProcessKeys(argv[1], outputs, options, totals);
+		if (stats)
+			PrintStats(totals);
+		if (failed != 0)
+			exit(-3);
+		return 0;
+	}
 
-	std::ifstream keyfile;
-	keyfile.open(argv[2], std::ios::in | std::ios::binary | std::ios::ate);
+	if (patch) {
+		options.threads = threads > 0 ? threads : 1;
+		HexStats totals;
+		bool result = MakePatch(argv[1], argv[2], argv[3], options, totals);
+		if (stats)
+			PrintStats(totals);
+		if (!result)
+			exit(-3);
+		return 0;
+	}
 
-	if(!keyfile.is_open()) {
+	// Only the start of the key file is used, a large one is not read
+	uint8_t key[256];
+	int size = CipherContext::ReadKey(batch ? argv[1] : argv[2], key);
+	if (size < 0) {
 		std::cerr << "Error reading keyfile.\n";
 		exit(-2);
 	}
+	if (size == 0) {
+		std::cerr << "Keyfile is empty.\n";
+		exit(-2);
+	}
+	CipherContext context(key, size);
+
+	std::unique_ptr<CipherEngine> engine;
+	if (strcmp(cipher, "arc4") != 0) {
+		engine = CipherEngine::Create(cipher, key, size);
+		if (!engine) {
+			std::cerr << "Keyfile is too short for " << cipher << ".\n";
+			exit(-2);
+		}
+		options.engine = engine.get();
+	}
+
+	if (verify) {
+		VerifyMismatch mismatch;
+		if (IntelHex::Verify(argv[1], argv[3], context, mismatch))
+			return 0;
+		if (mismatch.reason == NULL)
+			exit(-3);
 
-	keyfile.seekg(0, std::ios::end);
-	int size = keyfile.tellg();
-	keyfile.seekg(0, std::ios::beg);
+		std::cerr << argv[3] << ":" << mismatch.line << ": " << mismatch.reason;
+		if (!mismatch.truncated)
+			std::cerr << " at address 0x" << std::hex << mismatch.address;
+		if (mismatch.expected != mismatch.found) {
+			std::cerr << " (expected 0x" << (int)mismatch.expected
+				<< ", found 0x" << (int)mismatch.found << ")";
+		}
+		std::cerr << "\n";
+		exit(-4);
+	}
+
+	// The previous plain version is repacked like the input, so the layouts
+	// can be compared
+	IntelHex previousFiles[2];
+	if (previous[0] != NULL) {
+		if (!Load(previousFiles[0], previous[0], options)
+			|| !Load(previousFiles[1], previous[1], options)) {
+			std::cerr << "Error reading previous version.\n";
+			exit(-1);
+		}
+		previousFiles[0].Repack(options.repack);
+		options.previous = previousFiles;
+	}
+
+	std::vector<Job> jobs;
+	if (!batch) {
+		Job job = { argv[1], argv[3] };
+		jobs.push_back(job);
+	} else if (argc == 3) {
+		if (!ReadJobList(argv[2], jobs)) {
+			std::cerr << "Error reading file list.\n";
+			exit(-1);
+		}
+	} else {
+		for (int i = 2; i < argc; i += 2) {
+			Job job = { argv[i], argv[i + 1] };
+			jobs.push_back(job);
+		}
+	}
 
-	uint8_t key[size];
-	keyfile.read((char*)key, size);
-	file.Cipher(key, size);
+	// Batches run one file per thread, a single file uses all of them
+	if (threads > 0)
+		options.threads = threads;
+	else if (jobs.size() == 1)
+		options.threads = std::max(1u, std::thread::hardware_concurrency());
 
-	file.Write(argv[3]);
+	HexStats totals;
+	int failed = ProcessAll(jobs, context, options, totals);
+	if (stats)
+		PrintStats(totals);
+	if (failed != 0)
+		exit(-3);
 }
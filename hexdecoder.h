@@ -0,0 +1,270 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef HEXDECODER_H
+#define HEXDECODER_H
+
+/// Decoder for ciphered intel hex files, for flashers and bootloaders.
+/// The file is pushed in chunks of any size, as it comes from the link, and
+/// each record is given to a callback once its line is complete, with the data
+/// deciphered. It uses no heap, no exceptions and no C++ library, only the
+/// fixed size decoder state: the ARC4 state and one decoded line.
+/// The keystream is the same as IntelHex::Cipher: only data records consume
+/// it, and each record starts again from the beginning of the generator.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arcfour.h"
+
+
+/// Results of hex_decoder_push and hex_decoder_finish.
+enum {
+	kHexDecoderOK = 0,
+		// More data is expected
+	kHexDecoderDone,
+		// The end record was found, the data after it is ignored
+	kHexDecoderBadStart,
+	kHexDecoderTooLong,
+	kHexDecoderNotHex,
+	kHexDecoderChecksum,
+	kHexDecoderLength,
+	kHexDecoderNoEnd,
+	kHexDecoderAborted
+		// The callback returned non zero
+};
+
+
+/// A record, as given to the callback.
+struct hex_decoder_record {
+	uint8_t type;
+	uint8_t length;
+	uint16_t address;
+		// As written in the record
+	uint32_t absolute;
+		// With the extended address of the records before, for data records
+	const uint8_t* data;
+		// Deciphered for data records. Only valid during the callback.
+};
+
+
+/// Called for each record, including the extended addresses and the end.
+/// @returns 0 to go on, anything else stops the decoder.
+typedef int (*hex_record_callback)(void* cookie,
+	const struct hex_decoder_record* record);
+
+
+struct hex_decoder {
+	uint8_t state[256];
+		// ARC4 state, after the drop of the start of the keystream
+	uint8_t line[260];
+		// Decoded bytes of the current line
+	uint16_t digits;
+		// In the current line, 0 before the ':'
+	uint8_t sum;
+	uint8_t phase;
+		// Where in the line the decoder is
+	uint8_t status;
+		// kHexDecoderOK until the end record or an error
+	uint32_t extended;
+	uint32_t lines;
+		// Current line, counted from 1. On errors, the line which failed.
+	hex_record_callback callback;
+	void* cookie;
+};
+
+
+/// Where the decoder is in the current line.
+enum {
+	kHexDecoderWaitStart = 0,
+		// Before the ':'
+	kHexDecoderInLine,
+	kHexDecoderCarriageReturn
+		// After the digits, a '\r' was found
+};
+
+
+/// Start decoding with the state of CipherContext::CopyState, so the device
+/// need not store the key or run the key schedule.
+static void hex_decoder_init_state(struct hex_decoder* decoder,
+	const uint8_t state[256], hex_record_callback callback, void* cookie)
+{
+	int i;
+	for (i = 0; i < 256; i++)
+		decoder->state[i] = state[i];
+	decoder->digits = 0;
+	decoder->sum = 0;
+	decoder->phase = kHexDecoderWaitStart;
+	decoder->status = kHexDecoderOK;
+	decoder->extended = 0;
+	decoder->lines = 1;
+	decoder->callback = callback;
+	decoder->cookie = cookie;
+}
+
+
+/// Start decoding with a key, the same as for CipherContext.
+static void hex_decoder_init(struct hex_decoder* decoder, const uint8_t* key,
+	int len, hex_record_callback callback, void* cookie)
+{
+	uint8_t state[256];
+	uint8_t i = 0;
+	uint8_t j = 0;
+	int n;
+
+	arcfour_key_setup(state, key, len);
+	// Drop the first 256 bytes of keystream, without storing them
+	for (n = 0; n < 256; n++) {
+		uint8_t si;
+		i++;
+		si = state[i];
+		j += si;
+		state[i] = state[j];
+		state[j] = si;
+	}
+	hex_decoder_init_state(decoder, state, callback, cookie);
+}
+
+
+/// Value of a hex digit, or 16 for anything else.
+static inline uint8_t hex_decoder_digit(uint8_t c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return 16;
+}
+
+
+/// Check, decipher and report the line just decoded.
+static int hex_decoder_line(struct hex_decoder* decoder)
+{
+	uint8_t* line = decoder->line;
+	struct hex_decoder_record record;
+	int bytes = decoder->digits / 2;
+
+	if (decoder->digits < 9)
+		return kHexDecoderBadStart;
+	if (decoder->digits & 1)
+		return kHexDecoderNotHex;
+	if (decoder->sum != 0)
+		return kHexDecoderChecksum;
+	if (line[0] + 5 != bytes)
+		return kHexDecoderLength;
+
+	record.type = line[3];
+	record.length = line[0];
+	record.address = (line[1] << 8) | line[2];
+	record.absolute = decoder->extended + record.address;
+	record.data = line + 4;
+
+	if (record.type == 0) {
+		// The same as keystream_generate, one byte at a time
+		uint8_t* state = decoder->state;
+		uint8_t* data = line + 4;
+		uint8_t i = 0;
+		uint8_t j = 0;
+		int n;
+		for (n = 0; n < record.length; n++) {
+			uint8_t si, sj;
+			i++;
+			si = state[i];
+			j += si;
+			sj = state[j];
+			state[i] = sj;
+			state[j] = si;
+			data[n] ^= state[(uint8_t)(si + sj)];
+		}
+	} else if (record.type == 2 && record.length == 2)
+		decoder->extended = (uint32_t)((line[4] << 8) | line[5]) << 4;
+	else if (record.type == 4 && record.length == 2)
+		decoder->extended = (uint32_t)((line[4] << 8) | line[5]) << 16;
+
+	if (decoder->callback != NULL
+		&& decoder->callback(decoder->cookie, &record) != 0)
+		return kHexDecoderAborted;
+	return record.type == 1 ? kHexDecoderDone : kHexDecoderOK;
+}
+
+
+/// Decode the next bytes of the file.
+/// @returns kHexDecoderOK to get more, kHexDecoderDone once the end record is
+/// found, or an error. The same result is returned for any data after that.
+static int hex_decoder_push(struct hex_decoder* decoder, const uint8_t* data,
+	size_t length)
+{
+	size_t n;
+
+	if (decoder->status != kHexDecoderOK)
+		return decoder->status;
+
+	for (n = 0; n < length; n++) {
+		uint8_t c = data[n];
+		int result = kHexDecoderOK;
+
+		if (decoder->phase == kHexDecoderWaitStart) {
+			if (c != ':')
+				result = kHexDecoderBadStart;
+			else {
+				decoder->phase = kHexDecoderInLine;
+				decoder->digits = 0;
+				decoder->sum = 0;
+			}
+		} else if (c == '\n') {
+			result = hex_decoder_line(decoder);
+			decoder->phase = kHexDecoderWaitStart;
+			if (result == kHexDecoderOK)
+				decoder->lines++;
+		} else if (decoder->phase == kHexDecoderCarriageReturn) {
+			// Only the end of line may follow
+			result = kHexDecoderNotHex;
+		} else if (c == '\r') {
+			decoder->phase = kHexDecoderCarriageReturn;
+		} else {
+			uint8_t value = hex_decoder_digit(c);
+			if (value > 15)
+				result = kHexDecoderNotHex;
+			else if (decoder->digits >= 2 * sizeof(decoder->line))
+				result = kHexDecoderTooLong;
+			else {
+				uint8_t* byte = &decoder->line[decoder->digits / 2];
+				if (decoder->digits & 1) {
+					*byte |= value;
+					decoder->sum += *byte;
+				} else
+					*byte = value << 4;
+				decoder->digits++;
+			}
+		}
+
+		if (result != kHexDecoderOK) {
+			decoder->status = result;
+			return result;
+		}
+	}
+	return kHexDecoderOK;
+}
+
+
+/// Check that the whole file was decoded, after the last push.
+/// @returns kHexDecoderDone if it was, or an error.
+static int hex_decoder_finish(struct hex_decoder* decoder)
+{
+	if (decoder->status != kHexDecoderOK)
+		return decoder->status;
+
+	// The end record may be the last line, without an end of line
+	decoder->status = kHexDecoderNoEnd;
+	if (decoder->phase != kHexDecoderWaitStart) {
+		int result = hex_decoder_line(decoder);
+		decoder->phase = kHexDecoderWaitStart;
+		if (result != kHexDecoderOK)
+			decoder->status = result;
+	}
+	return decoder->status;
+}
+
+#endif
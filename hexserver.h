@@ -0,0 +1,420 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef HEXSERVER_H
+#define HEXSERVER_H
+
+/// A server keeping the cipher contexts of named keys in memory, and ciphering
+/// files for clients connecting to a Unix socket. This saves the process
+/// startup and key setup of each run of hexcrypt.
+///
+/// A request is a few lines of text:
+///   FILE or STREAM
+///   key name
+///   format flags: "lowercase" and "lf", separated by spaces, or nothing
+///   for FILE, the input and output file names, as seen by the server
+/// A FILE request is answered with a status line once the output is written.
+/// A STREAM request is followed by the contents of the input file. The server
+/// answers with the ciphered records as they are read, then the status line.
+/// The status line is "OK" or "ERROR" followed by a message. Neither starts
+/// with ':', so it can't be confused with a record.
+
+#include "ihex.h"
+
+#ifdef HEXCRYPT_USE_MMAP
+
+#include <condition_variable>
+#include <deque>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+class HexServer {
+	public:
+		HexServer();
+		~HexServer();
+
+		bool AddKey(const std::string& name, const char* filename);
+			// Load a key file, requests then refer to it by name.
+		bool Listen(const char* path);
+			// Create the socket, replacing a stale one. Fails with
+			// EADDRINUSE if another server answers on it. Only the user
+			// running the server may connect, as FILE requests open files
+			// with its rights.
+		void Run(unsigned threads);
+			// Accept connections and handle them on a pool of threads, until
+			// Stop is called.
+		void Stop();
+
+		static bool Request(const char* path, const char* key,
+			const HexFormat& format, const char* input, const char* output,
+			std::string& error);
+			// Ask a server to cipher a file into another. Relative names are
+			// sent as absolute ones.
+		static bool Request(const char* path, const char* key,
+			const HexFormat& format, std::istream& input, std::ostream& output,
+			std::string& error);
+			// Send the input to a server, and write the ciphered records it
+			// sends back to the output.
+
+	private:
+		static int Connect(const char* path, std::string& error);
+		static std::string FormatFlags(const HexFormat& format);
+		void Handle(int fd);
+
+		std::map<std::string, CipherContext> fKeys;
+		CipherContextCache fContexts;
+			// Names sharing a key share its setup
+		int fSocket;
+		std::string fPath;
+		std::atomic<bool> fStopped;
+
+		std::mutex fLock;
+		std::condition_variable fWaiting;
+		std::deque<int> fConnections;
+			// Accepted and not handled yet.
+};
+
+
+HexServer::HexServer()
+	: fSocket(-1)
+	, fStopped(false)
+{
+}
+
+
+HexServer::~HexServer()
+{
+	if (fSocket >= 0) {
+		close(fSocket);
+		unlink(fPath.c_str());
+	}
+}
+
+
+bool HexServer::AddKey(const std::string& name, const char* filename)
+{
+	uint8_t key[256];
+	int length = CipherContext::ReadKey(filename, key);
+	if (length <= 0)
+		return false;
+
+	fKeys.erase(name);
+	fKeys.insert(std::make_pair(name, fContexts.Get(key, length)));
+	return true;
+}
+
+
+bool HexServer::Listen(const char* path)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(address.sun_path, path);
+
+	// A socket left by a server which didn't exit cleanly would make bind
+	// fail. It is only removed when nothing answers on it anymore, anything
+	// else with that name is kept.
+	struct stat info;
+	if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (probe < 0)
+			return false;
+		int result = connect(probe, (sockaddr*)&address, sizeof(address));
+		int error = errno;
+		close(probe);
+		if (result == 0)
+			error = EADDRINUSE;
+		if (result == 0 || error != ECONNREFUSED) {
+			errno = error;
+			return false;
+		}
+		unlink(path);
+	}
+
+	// Restricted before listening, so no one else can connect in between
+	fSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fSocket < 0)
+		return false;
+	bool bound = bind(fSocket, (sockaddr*)&address, sizeof(address)) == 0;
+	if (!bound || chmod(path, 0600) != 0 || listen(fSocket, 64) != 0) {
+		int error = errno;
+		close(fSocket);
+		fSocket = -1;
+		if (bound)
+			unlink(path);
+		errno = error;
+		return false;
+	}
+
+	fPath = path;
+	return true;
+}
+
+
+void HexServer::Run(unsigned threads)
+{
+	// A client going away must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < std::max(1u, threads); i++) {
+		workers.push_back(std::thread([this]() {
+			while (true) {
+				std::unique_lock<std::mutex> lock(fLock);
+				fWaiting.wait(lock, [this]() {
+					return fStopped || !fConnections.empty();
+				});
+				if (fConnections.empty())
+					return;
+				int fd = fConnections.front();
+				fConnections.pop_front();
+				lock.unlock();
+				Handle(fd);
+				close(fd);
+			}
+		}));
+	}
+
+	while (!fStopped) {
+		int fd = accept(fSocket, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		std::lock_guard<std::mutex> lock(fLock);
+		fConnections.push_back(fd);
+		fWaiting.notify_one();
+	}
+
+	// Connections already accepted are still handled
+	{
+		std::lock_guard<std::mutex> lock(fLock);
+		fStopped = true;
+	}
+	fWaiting.notify_all();
+	for (auto& worker: workers)
+		worker.join();
+}
+
+
+void HexServer::Stop()
+{
+	fStopped = true;
+	// Wake up accept
+	shutdown(fSocket, SHUT_RDWR);
+}
+
+
+/// Handle one request. The connection is closed by the caller, once the
+/// buffers are gone.
+void HexServer::Handle(int fd)
+{
+	FileStreamBuffer inBuffer(fd);
+	FileStreamBuffer outBuffer(fd);
+	std::istream in(&inBuffer);
+	std::ostream out(&outBuffer);
+
+	std::string command, key, flags;
+	std::getline(in, command);
+	std::getline(in, key);
+	std::getline(in, flags);
+
+	HexFormat format;
+	std::istringstream words(flags);
+	std::string word;
+	while (words >> word) {
+		if (word == "lowercase")
+			format.lowercase = true;
+		else if (word == "lf")
+			format.crlf = false;
+	}
+
+	std::string error;
+	auto context = fKeys.find(key);
+	if (!in) {
+		error = "Incomplete request";
+	} else if (context == fKeys.end()) {
+		error = "Unknown key " + key;
+	} else if (command == "FILE") {
+		std::string input, output;
+		std::getline(in, input);
+		std::getline(in, output);
+
+		std::ifstream inFile(input.c_str());
+		std::ofstream outFile;
+		if (!inFile.is_open())
+			error = "Can't read input file: " + std::string(strerror(errno));
+		else {
+			outFile.open(output.c_str());
+			if (!outFile.is_open()) {
+				error = "Can't write output file: "
+					+ std::string(strerror(errno));
+			}
+		}
+		if (error.empty()) {
+			// Same as IntelHex::Stream on the files, compressed or not
+			DecompressStreamBuffer decompressor(inFile.rdbuf());
+			std::istream plain(&decompressor);
+			Compression compression = compression_of_name(output);
+			CompressStreamBuffer compressor(outFile.rdbuf(), compression);
+			std::ostream ciphered(compression == kCompressionNone
+				? (std::streambuf*)outFile.rdbuf() : &compressor);
+			IntelHex::Stream(plain, ciphered, context->second, format, error);
+			if (compression != kCompressionNone && !compressor.Finish()
+				&& error.empty())
+				error = compressor.Error();
+			if (decompressor.Error() != NULL)
+				error = decompressor.Error();
+		}
+	} else if (command == "STREAM") {
+		IntelHex::Stream(in, out, context->second, format, error);
+	} else
+		error = "Unknown request " + command;
+
+	try {
+		out.exceptions(std::ios::goodbit);
+		out.clear();
+		// Parse errors show the line on the next ones, only the first is sent
+		if (error.empty())
+			out << "OK\n";
+		else
+			out << "ERROR " << error.substr(0, error.find('\n')) << "\n";
+		out.flush();
+	} catch (std::ios_base::failure&) {
+		// The client is gone
+	}
+}
+
+
+int HexServer::Connect(const char* path, std::string& error)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		error = "Socket name too long";
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		error = "Can't connect to server: " + std::string(strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+std::string HexServer::FormatFlags(const HexFormat& format)
+{
+	std::string flags;
+	if (format.lowercase)
+		flags += "lowercase ";
+	if (!format.crlf)
+		flags += "lf";
+	return flags;
+}
+
+
+/// Names from the current directory, the server may run somewhere else.
+static std::string absolute_path(const char* name)
+{
+	if (name[0] == '/')
+		return name;
+	char directory[4096];
+	if (getcwd(directory, sizeof(directory)) == NULL)
+		return name;
+	return std::string(directory) + "/" + name;
+}
+
+
+bool HexServer::Request(const char* path, const char* key,
+	const HexFormat& format, const char* input, const char* output,
+	std::string& error)
+{
+	int fd = Connect(path, error);
+	if (fd < 0)
+		return false;
+
+	std::string request = std::string("FILE\n") + key + "\n"
+		+ FormatFlags(format) + "\n" + absolute_path(input) + "\n"
+		+ absolute_path(output) + "\n";
+
+	std::string status;
+	{
+		FileStreamBuffer buffer(fd);
+		std::iostream stream(&buffer);
+		stream << request << std::flush;
+		std::getline(stream, status);
+	}
+	close(fd);
+
+	if (status == "OK")
+		return true;
+	error = status.empty() ? "No answer from server"
+		: status.substr(std::min<size_t>(status.size(), 6));
+	return false;
+}
+
+
+bool HexServer::Request(const char* path, const char* key,
+	const HexFormat& format, std::istream& input, std::ostream& output,
+	std::string& error)
+{
+	int fd = Connect(path, error);
+	if (fd < 0)
+		return false;
+	signal(SIGPIPE, SIG_IGN);
+
+	// The server answers while it is still reading, so the input is sent from
+	// another thread
+	std::thread sender([&]() {
+		FileStreamBuffer buffer(fd);
+		std::ostream stream(&buffer);
+		stream << "STREAM\n" << key << "\n" << FormatFlags(format) << "\n";
+		char block[65536];
+		while (stream && input.read(block, sizeof(block)).gcount() > 0)
+			stream.write(block, input.gcount());
+		stream.flush();
+		shutdown(fd, SHUT_WR);
+	});
+
+	std::string status;
+	{
+		FileStreamBuffer buffer(fd);
+		std::istream stream(&buffer);
+		std::string line;
+		while (std::getline(stream, line)) {
+			if (line.empty() || line[0] != ':') {
+				status = line;
+				break;
+			}
+			output << line << "\n";
+		}
+	}
+	sender.join();
+	close(fd);
+	output.flush();
+
+	if (status == "OK")
+		return true;
+	error = status.empty() ? "No answer from server"
+		: status.substr(std::min<size_t>(status.size(), 6));
+	return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,115 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef HEXSTATS_H
+#define HEXSTATS_H
+
+/// Counters and timers for the hot paths of IntelHex.
+/// They are enabled by default. Build with HEXCRYPT_STATS=0 to remove them
+/// entirely: the macros then expand to nothing and the counters stay at 0.
+
+#include <chrono>
+
+#include <stdint.h>
+
+#ifndef HEXCRYPT_STATS
+#define HEXCRYPT_STATS 1
+#endif
+
+
+/// What was done by IntelHex, and how long it took.
+struct HexStats {
+	HexStats() { Reset(); }
+
+	void Reset() {
+		lines = dataRecords = bytesCiphered = bytesWritten = allocations = 0;
+		readTime = cipherTime = writeTime = 0;
+	}
+
+	HexStats& operator+=(const HexStats& other) {
+		lines += other.lines;
+		dataRecords += other.dataRecords;
+		bytesCiphered += other.bytesCiphered;
+		bytesWritten += other.bytesWritten;
+		allocations += other.allocations;
+		readTime += other.readTime;
+		cipherTime += other.cipherTime;
+		writeTime += other.writeTime;
+		return *this;
+	}
+
+	uint64_t lines;
+		// Lines parsed
+	uint64_t dataRecords;
+		// Data records ciphered
+	uint64_t bytesCiphered;
+	uint64_t bytesWritten;
+	uint64_t allocations;
+		// Buffers allocated for file contents, records and output
+
+	double readTime;
+	double cipherTime;
+	double writeTime;
+		// In seconds. Streaming counts everything as read time.
+};
+
+
+/// Interface to forward the statistics somewhere else, for example a metrics
+/// system. It is called at the end of each phase.
+class HexStatsListener {
+	public:
+		virtual ~HexStatsListener() {}
+
+		virtual void PhaseDone(const char* phase, double seconds,
+			const HexStats& total) = 0;
+			// @phase "read", "cipher", "write" or "stream".
+			// @seconds how long this phase took.
+			// @total all the statistics so far.
+};
+
+
+/// Measure the time spent in a scope, add it to one of the timers and notify
+/// the listener.
+class HexStatsPhase {
+	public:
+		HexStatsPhase(HexStats& stats, double HexStats::*timer,
+			HexStatsListener* listener, const char* name)
+			: fStats(stats)
+			, fTimer(timer)
+			, fListener(listener)
+			, fName(name)
+			, fStart(std::chrono::steady_clock::now())
+		{
+		}
+
+		~HexStatsPhase() {
+			double elapsed = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - fStart).count();
+			fStats.*fTimer += elapsed;
+			if (fListener != NULL)
+				fListener->PhaseDone(fName, elapsed, fStats);
+		}
+
+	private:
+		HexStats& fStats;
+		double HexStats::*fTimer;
+		HexStatsListener* fListener;
+		const char* fName;
+		std::chrono::steady_clock::time_point fStart;
+};
+
+
+#if HEXCRYPT_STATS
+#define HEXSTATS_ADD(stats, counter, value) ((stats).counter += (value))
+#define HEXSTATS_PHASE(stats, timer, listener, name) \
+	HexStatsPhase _phase(stats, &HexStats::timer, listener, name)
+#else
+// The statistics are still named, so functions taking them don't warn about
+// an unused parameter
+#define HEXSTATS_ADD(stats, counter, value) ((void)(stats))
+#define HEXSTATS_PHASE(stats, timer, listener, name) \
+	((void)(stats), (void)(listener))
+#endif
+
+#endif
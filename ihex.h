@@ -2,16 +2,45 @@
  * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
  * This program is distributed under the terms of the MIT licence.
  */
+#ifndef IHEX_H
+#define IHEX_H
 
+#include <atomic>
 #include <exception>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <errno.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__) || defined(__HAIKU__)
+#define HEXCRYPT_USE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "addressindex.h"
 #include "arcfour.h"
+#include "cipherengine.h"
+#include "compression.h"
+#include "crc32.h"
+#include "hexcodec.h"
+#include "hexstats.h"
+#include "pipeline.h"
+#include "sha256.h"
 
 /// ParseError exception, for internal use.
 /// Just a standard C++ exception with a text error message.
@@ -40,17 +69,130 @@ class ParseError: public std::exception
 };
 
 
+/// Why a line could not be parsed.
+enum ParseStatus {
+	kParseOK = 0,
+	kParseBadStart,
+	kParseTooLong,
+	kParseNotHex,
+	kParseChecksum,
+	kParseLength,
+	kParseNoEnd,
+	kParseTooLarge,
+	kParseBadAddress
+};
+
+
+/// A parse error, without exceptions or text. The message is only built when
+/// asked, from the data which was parsed.
+struct ParseFailure {
+	ParseFailure(ParseStatus status, int line, int column, size_t offset = 0,
+		size_t length = 0)
+		: status(status)
+		, line(line)
+		, column(column)
+		, offset(offset)
+		, length(length)
+	{
+	}
+
+	const char* Reason() const;
+	std::string Message(const char* data) const;
+		// Same text as ParseError, with the line and a caret.
+		// @data the parsed data, NULL to leave out the line.
+
+	ParseStatus status;
+	int line;
+	int column;
+	size_t offset;
+	size_t length;
+		// Where the line is in the parsed data.
+};
+
+
+const char* ParseFailure::Reason() const
+{
+	switch (status) {
+		case kParseOK:
+			return "no error";
+		case kParseBadStart:
+			return "not starting with ':' or too short";
+		case kParseTooLong:
+			return "line too long";
+		case kParseNotHex:
+			return "not an hexadecimal character";
+		case kParseChecksum:
+			return "checksum error";
+		case kParseLength:
+			return "mismatched length";
+		case kParseNoEnd:
+			return "unexpected end of file, no end record";
+		case kParseTooLarge:
+			return "file too large";
+		case kParseBadAddress:
+			return "extended address record not 2 bytes long";
+	}
+	return "unknown error";
+}
+
+
+std::string ParseFailure::Message(const char* data) const
+{
+	std::string text;
+	if (data != NULL)
+		text.assign(data + offset, length);
+	return ParseError(line, column, Reason(), text.c_str()).what();
+}
+
+
+/// Options for the generated text.
+struct HexFormat {
+	HexFormat()
+		: lowercase(false)
+		, crlf(true)
+	{
+	}
+
+	bool lowercase;
+		// Use a-f instead of A-F for hexadecimal digits.
+	bool crlf;
+		// End lines with "\r\n", or with just "\n".
+};
+
+
+/// Description of one record of an ihex file.
+/// The payload bytes are not stored here, but in a separate buffer shared by
+/// all the records of a file, at Offset(). Functions needing them take a
+/// pointer to the payload.
 class HexRecord {
 	public:
-		HexRecord(uint8_t* data) {
+		HexRecord(const uint8_t* data, uint32_t offset) {
 			size = data[0];
 			address = (data[1] << 8) | data[2];
 			type = data[3];
 			checksum = data[size + 4];
-			this->data.assign(&data[4], &data[size + 4]);
+			this->offset = offset;
+		}
+
+		HexRecord(uint8_t type, uint16_t address, uint8_t size,
+			const uint8_t* payload, uint32_t offset)
+			: offset(offset)
+			, address(address)
+			, size(size)
+			, type(type)
+		{
+			UpdateChecksum(payload);
 		}
 
-		void Generate(std::ostream& output) const throw(std::ios_base::failure);
+		void Generate(std::ostream& output, const uint8_t* payload,
+			const HexFormat& format = HexFormat()) const
+			throw(std::ios_base::failure);
+		size_t Generate(char* output, const uint8_t* payload,
+			const HexFormat& format = HexFormat()) const;
+		size_t GeneratedSize(const HexFormat& format = HexFormat()) const {
+			// ':', 5 header and checksum bytes, data and end of line
+			return size * 2 + 11 + (format.crlf ? 2 : 1);
+		}
 
 		bool operator==(const HexRecord& other) const {
 			if (size != other.size) return false;
@@ -60,227 +202,3058 @@ class HexRecord {
 			return true;
 		}
 
-		void UpdateChecksum() {
-			checksum = size + (address >> 8) + (address & 0xff) + type;
-			for(uint8_t i: data) {
-				checksum += i;
+		void UpdateChecksum(const uint8_t* payload) {
+			uint8_t sum = 0;
+			for(int i = 0; i < size; i++) {
+				sum += payload[i];
 			}
+			SetPayloadSum(sum);
+		}
+
+		void SetPayloadSum(uint8_t sum) {
+			// Update the checksum from the sum of the payload bytes
+			checksum = size + (address >> 8) + (address & 0xff) + type + sum;
 			checksum = -checksum;
 		}
 
+		void Cipher(uint8_t state[256], uint8_t* payload);
+
+		bool IsExtendedAddress() const {
+			return (type == 2 || type == 4) && size == 2;
+		}
+		uint32_t ExtendedAddress(const uint8_t* payload) const {
+			// Base address set by an extended segment (type 2) or linear
+			// (type 4) address record
+			uint32_t value = (payload[0] << 8) | payload[1];
+			return type == 4 ? value << 16 : value << 4;
+		}
+
+		uint32_t Offset() const { return offset; }
+		void SetOffset(uint32_t offset) { this->offset = offset; }
+		uint8_t Size() const { return size; }
+		uint16_t Address() const { return address; }
+
 	private:
-		uint8_t size;
+		uint32_t offset;
 		uint16_t address;
+		uint8_t size;
 	public:
 		uint8_t type;
-		std::vector<uint8_t> data;
 	private:
 		uint8_t checksum;
 };
 
 
-void HexRecord::Generate(std::ostream& output) const throw(std::ios_base::failure)
+void HexRecord::Generate(std::ostream& output, const uint8_t* payload,
+	const HexFormat& format) const throw(std::ios_base::failure)
 {
-	output << ':';
+	char line[523];
+	output.write(line, Generate(line, payload, format));
+}
 
-	uint8_t buffer[size + 5];
-	buffer[0] = size;
-	buffer[1] = address >> 8;
-	buffer[2] = address;
-	buffer[3] = type;
 
-	for(int i = 0; i < size; i++)
-	{
-		buffer[i + 4] = data[i];
+/// Generate the record text into a buffer.
+/// @output must have room for GeneratedSize() chars.
+/// @payload the data bytes of the record.
+/// @returns the number of chars written.
+size_t HexRecord::Generate(char* output, const uint8_t* payload,
+	const HexFormat& format) const
+{
+	char* start = output;
+	*output++ = ':';
+
+	uint8_t header[4] = { size, (uint8_t)(address >> 8), (uint8_t)address, type };
+	hex_encode_scalar(header, 4, output, format.lowercase);
+	output += 8;
+
+	hex_encode(payload, size, output, format.lowercase);
+	output += 2 * size;
+
+	hex_encode_scalar(&checksum, 1, output, format.lowercase);
+	output += 2;
+
+	if (format.crlf)
+		*output++ = '\r';
+	*output++ = '\n';
+	return output - start;
+}
+
+
+
+
+/// Generate the keystream for one record.
+/// This is the same as arcfour_generate_stream, including restarting the
+/// indices from 0 on each call, but keeps them in 8-bit registers so no
+/// modulo is needed.
+static inline void keystream_generate(uint8_t state[256], uint8_t* out,
+	size_t len)
+{
+	uint8_t i = 0;
+	uint8_t j = 0;
+	for (size_t idx = 0; idx < len; idx++) {
+		i++;
+		uint8_t si = state[i];
+		j += si;
+		uint8_t sj = state[j];
+		state[i] = sj;
+		state[j] = si;
+		out[idx] = state[(uint8_t)(si + sj)];
 	}
+}
 
-	buffer[size + 4] = checksum;
 
-	for(int i = 0; i < size + 5; i++)
-	{
-		char n1, n2;
-		n1 = buffer[i] >> 4;
-		n2 = buffer[i] & 0xF;
+/// Advance the state as keystream_generate would, without the output.
+static inline void keystream_advance(uint8_t state[256], size_t len)
+{
+	uint8_t i = 0;
+	uint8_t j = 0;
+	for (size_t idx = 0; idx < len; idx++) {
+		i++;
+		uint8_t si = state[i];
+		j += si;
+		state[i] = state[j];
+		state[j] = si;
+	}
+}
 
-		if (n1 < 10)
-			n1 += '0';
-		else
-			n1 += 'A' - 10;
 
-		if (n2 < 10)
-			n2 += '0';
-		else
-			n2 += 'A' - 10;
+/// XOR data with the keystream, and return the sum of the resulting bytes.
+static inline uint8_t xor_and_sum(uint8_t* data, const uint8_t* stream,
+	size_t len)
+{
+	size_t i = 0;
+	uint8_t sum = 0;
+
+#if defined(HEXCODEC_X86) && defined(__SSE2__)
+	__m128i total = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16) {
+		__m128i bytes = _mm_xor_si128(_mm_loadu_si128((__m128i*)(data + i)),
+			_mm_loadu_si128((const __m128i*)(stream + i)));
+		_mm_storeu_si128((__m128i*)(data + i), bytes);
+		total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+	}
+	total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+	sum = _mm_cvtsi128_si32(total);
+#else
+	const uint64_t mask = 0x00FF00FF00FF00FFull;
+	while (i + 8 <= len) {
+		// Sum the bytes in 16-bit lanes, folded often enough to not overflow
+		uint64_t lanes = 0;
+		for (int n = 0; n < 64 && i + 8 <= len; n++, i += 8) {
+			uint64_t word, key;
+			memcpy(&word, data + i, 8);
+			memcpy(&key, stream + i, 8);
+			word ^= key;
+			memcpy(data + i, &word, 8);
+			lanes += (word & mask) + ((word >> 8) & mask);
+		}
+		lanes += lanes >> 32;
+		lanes += lanes >> 16;
+		sum += lanes;
+	}
+#endif
 
-		output << n1 << n2;
+	for (; i < len; i++) {
+		data[i] ^= stream[i];
+		sum += data[i];
 	}
+	return sum;
+}
+
+
+/// Cipher the data of a single record with the running ARC4 state.
+/// Only data records are ciphered, extended addresses and other things are
+/// left untouched and do not consume the keystream.
+void HexRecord::Cipher(uint8_t state[256], uint8_t* payload)
+{
+	if (type != 0)
+		return;
 
-	output << "\r\n";
+	uint8_t stream[256];
+	keystream_generate(state, stream, size);
+	SetPayloadSum(xor_and_sum(payload, stream, size));
 }
 
 
 
 
-/// Read and write Intel hex format files.
-class IntelHex {
+/// ARC4 state ready to cipher a file: the key is set up and the start of the
+/// keystream is dropped. It is only 256 bytes, and can be copied and reused to
+/// cipher any number of files with the same key. Ciphering works on a copy of
+/// the state, so a context can be shared by several threads.
+class CipherContext {
 	public:
-		bool Read(const char* filename);
-		bool Write(const char* filename);
+		CipherContext(const uint8_t* key, int len);
 
-		void Cipher(const uint8_t* key, int len);
-			// ARC4 is symmetric, so this also deciphers.
+		static int ReadKey(const char* filename, uint8_t key[256]);
+#ifdef HEXCRYPT_USE_MMAP
+		static int ReadKey(int fd, uint8_t key[256]);
+		static std::unique_ptr<CipherContext> FromFile(int fd);
+#endif
+		static std::unique_ptr<CipherContext> FromFile(const char* filename);
+			// Key schedule from a key file, NULL if it can't be read or
+			// is empty.
 
-		bool operator==(const IntelHex& other) { return fData == other.fData; }
+		void CopyState(uint8_t state[256]) const {
+			memcpy(state, fState, sizeof(fState));
+		}
 
 	private:
-		void Parse(std::istream& input) throw(std::ios_base::failure, ParseError);
-		void Generate(std::ostream& output) throw(std::ios_base::failure);
-		void WriteRecord(std::ostream& output, const uint8_t type, const uint16_t address,
-			const std::vector<uint8_t> data) throw(std::ios_base::failure);
-
-		std::vector<HexRecord> fData;
+		uint8_t fState[256];
 };
 
 
-/// Read and parse an intel ihex file
-/// @filename name of the file to read
-/// @returns true on success, false on error.
-bool IntelHex::Read(const char* filename)
+CipherContext::CipherContext(const uint8_t* key, int len)
 {
-	std::ifstream file;
-	// Configure the object to throw exceptions, so we can catch them
-	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	arcfour_key_setup(fState, key, len);
 
-	try {
-		file.open(filename);
-		Parse(file);
-		return true;
-	} catch(std::ios_base::failure e) {
-		std::cerr << "Can't read input file: " << e.what() << std::endl;
-		return false;
-	} catch(ParseError e) {
-		std::cerr << e.what() << std::endl;
-		return false;
-	}
+	// There is a known attack on ARC4 allowing to recover the key from:
+	// - An unencrypted message
+	// - The matching first 256 bytes of encrypted data
+	// Skipping the first 256 bytes of the keystream avoids this. Of course the
+	// decoder must do the same.
+	uint8_t stream[256];
+	arcfour_generate_stream(fState, stream, 256);
 }
 
 
-/// Write the data to an ihex file.
-bool IntelHex::Write(const char* filename)
+/// Read the part of a key file used by the key schedule.
+/// The schedule only ever uses the first 256 bytes of the key, and setting it
+/// up with them gives the same state as with the whole key, so there is no
+/// need to read more, however large the file is.
+/// @key where to store the key bytes.
+/// @returns the number of bytes read, 0 for an empty file, -1 on error.
+int CipherContext::ReadKey(const char* filename, uint8_t key[256])
 {
-	std::ofstream file;
-	// Configure the object to throw exceptions, so we can catch them
-	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+#ifdef HEXCRYPT_USE_MMAP
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int length = ReadKey(fd, key);
+	close(fd);
+	return length;
+#else
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	if (!file.is_open())
+		return -1;
+	file.read((char*)key, 256);
+	if (file.bad())
+		return -1;
+	return file.gcount();
+#endif
+}
 
-	try {
-		file.open(filename);
-		Generate(file);
-		return true;
-	} catch(std::ios_base::failure e) {
-		std::cerr << "Can't write output file: " << e.what() << std::endl;
-		return false;
+
+#ifdef HEXCRYPT_USE_MMAP
+/// Read the key from the current position of a file descriptor.
+/// The file descriptor is not closed.
+int CipherContext::ReadKey(int fd, uint8_t key[256])
+{
+	int length = 0;
+	while (length < 256) {
+		ssize_t got = read(fd, key + length, 256 - length);
+		if (got == 0)
+			break;
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		length += got;
 	}
+	return length;
 }
 
 
-/// Parse intel hex data from input stream.
-/// Will throw exceptions on errors reading the file.
-void IntelHex::Parse(std::istream& input) throw(std::ios_base::failure, ParseError)
+std::unique_ptr<CipherContext> CipherContext::FromFile(int fd)
 {
-	fData.clear();
-	uint32_t extended = 0;
+	uint8_t key[256];
+	int length = ReadKey(fd, key);
+	if (length <= 0)
+		return std::unique_ptr<CipherContext>();
+	return std::unique_ptr<CipherContext>(new CipherContext(key, length));
+}
+#endif
 
-	for(int l = 1; true; l++) {
-		char line[1026];
-		uint8_t buffer[512];
-
-		// Read line from file
-		input.getline(line, sizeof(line));
-		std::streamsize length = input.gcount() - 1;
-			// - 1 because the \n is replaced with the NULL char.
-
-		if (length < 10 || line[0] != ':')
-			throw ParseError(l, 0, "not starting with ':' or too short", line);
-
-		// Convert line to bytes
-		int byte = 0;
-		uint8_t sum = 0;
-		for(int i = 1; i < length ; i ++) {
-			uint8_t nibble = line[i];
-			if (nibble >= '0' && nibble <= '9')
-				nibble -= '0';
-			else if (nibble >= 'a' && nibble <= 'f')
-				nibble -= 'a' - 10;
-			else if (nibble >= 'A' && nibble <= 'F')
-				nibble -= 'A' - 10;
-			else if (nibble == '\r' && i == length - 1)
-				break; // Ignore end of line char
-			else
-				throw ParseError(l, i, "not an hexadecimal character", line);
 
-			if (i & 1) {
-				// First nibble for current byte
-				buffer[byte] = nibble;
-			} else {
-				// Second nibble for current byte
-				buffer[byte] <<= 4;
-				buffer[byte] |= nibble;
+std::unique_ptr<CipherContext> CipherContext::FromFile(const char* filename)
+{
+	uint8_t key[256];
+	int length = ReadKey(filename, key);
+	if (length <= 0)
+		return std::unique_ptr<CipherContext>();
+	return std::unique_ptr<CipherContext>(new CipherContext(key, length));
+}
+
+
+/// A small cache of cipher contexts for the most recently used keys.
+/// Lookups use a fingerprint of the key, and the key itself is compared so
+/// colliding fingerprints can't return the wrong context. It is thread safe.
+/// The keys stay in memory until they are evicted or the cache is destroyed,
+/// so it should not outlive the work needing them.
+class CipherContextCache {
+	public:
+		CipherContextCache(size_t capacity = 8)
+			: fCapacity(capacity)
+		{
+		}
+
+		CipherContext Get(const uint8_t* key, int len);
 
-				sum += buffer[byte];
-				++byte;
+	private:
+		struct Entry {
+			Entry(uint64_t fingerprint, const std::string& key,
+				const CipherContext& context)
+				: fingerprint(fingerprint)
+				, key(key)
+				, context(context)
+			{
 			}
+
+			uint64_t fingerprint;
+			std::string key;
+			CipherContext context;
+		};
+
+		static std::string EffectiveKey(const uint8_t* key, int len);
+		static uint64_t Fingerprint(const std::string& key);
+
+		size_t fCapacity;
+		std::list<Entry> fEntries;
+			// Most recently used first
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> fIndex;
+		std::mutex fLock;
+};
+
+
+/// Get the context for a key, setting it up if it isn't in the cache.
+CipherContext CipherContextCache::Get(const uint8_t* key, int len)
+{
+	std::string effective = EffectiveKey(key, len);
+	uint64_t fingerprint = Fingerprint(effective);
+
+	std::lock_guard<std::mutex> lock(fLock);
+
+	auto found = fIndex.find(fingerprint);
+	if (found != fIndex.end()) {
+		if (found->second->key == effective) {
+			fEntries.splice(fEntries.begin(), fEntries, found->second);
+			return found->second->context;
 		}
 
-		if (sum != 0)
-			throw ParseError(l, length - 2, "checksum error", line);
+		// Another key with the same fingerprint, replace it
+		fEntries.erase(found->second);
+		fIndex.erase(found);
+	}
+
+	CipherContext context(key, len);
+	if (fCapacity == 0)
+		return context;
 
-		uint8_t count = buffer[0];
+	if (fEntries.size() >= fCapacity) {
+		fIndex.erase(fEntries.back().fingerprint);
+		fEntries.pop_back();
+	}
 
-		if (count + 5 != byte)
-			throw ParseError(l, 2, "mismatched length", line);
+	fEntries.push_front(Entry(fingerprint, effective, context));
+	fIndex[fingerprint] = fEntries.begin();
+	return context;
+}
 
-		HexRecord r = HexRecord(buffer);
-		fData.push_back(r);
-		if (r.type == 1)
-			return;
+
+/// The part of the key which affects the key setup.
+/// arcfour_key_setup reads key[i % len] for i < 256, so only the first 256
+/// bytes matter, and shorter keys must also be told apart by their length.
+std::string CipherContextCache::EffectiveKey(const uint8_t* key, int len)
+{
+	return std::string((const char*)key, len < 256 ? len : 256);
+}
+
+
+/// FNV-1a hash of the key.
+uint64_t CipherContextCache::Fingerprint(const std::string& key)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned char c: key) {
+		hash ^= c;
+		hash *= 0x100000001b3ull;
 	}
+	return hash;
 }
 
 
-void IntelHex::Generate(std::ostream& output) throw(std::ios_base::failure)
+
+
+/// Run work for each index from 0 to count (excluded), on up to the given
+/// number of threads. The calling thread is one of them.
+/// @work called with the index and the number of the thread running it.
+static void run_parallel(unsigned threads, size_t count,
+	const std::function<void(size_t, size_t)>& work)
 {
-	for (auto line: fData)
+	size_t threadCount = std::min<size_t>(threads, count);
+	std::atomic<size_t> next(0);
+
+	auto worker = [&](size_t thread) {
+		for (size_t i = next++; i < count; i = next++)
+			work(i, thread);
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < threadCount; i++)
+		workers.push_back(std::thread(worker, i));
+	worker(0);
+	for (auto& thread: workers)
+		thread.join();
+}
+
+
+/// Where a ciphered file doesn't match the plain one.
+struct VerifyMismatch {
+	VerifyMismatch()
+		: line(0)
+		, address(0)
+		, expected(0)
+		, found(0)
+		, truncated(false)
+		, reason(NULL)
+	{
+	}
+
+	int line;
+	uint64_t address;
+		// Absolute address of the first different byte, or of the record.
+	uint8_t expected;
+	uint8_t found;
+		// The plain and deciphered bytes, for different data.
+	bool truncated;
+		// One file ends before the other, there is no address.
+	const char* reason;
+};
+
+
+/// Digests of what Write produced, for signing it without reading it again.
+struct HexDigests {
+	HexDigests()
+		: textCrc32(0)
+		, payloadCrc32(0)
 	{
-		// Write data record
-		line.Generate(output);
+		memset(textSha256, 0, sizeof(textSha256));
+		memset(payloadSha256, 0, sizeof(payloadSha256));
 	}
+
+	void Print(std::ostream& output) const;
+		// One "name value" line per digest, in hexadecimal.
+
+	uint8_t textSha256[32];
+	uint32_t textCrc32;
+		// Of the whole file.
+	uint8_t payloadSha256[32];
+	uint32_t payloadCrc32;
+		// Of the data records payload, one after the other in file order.
+};
+
+
+void HexDigests::Print(std::ostream& output) const
+{
+	std::ostringstream text;
+	text << std::hex << std::setfill('0');
+	text << "text-sha256 ";
+	for (uint8_t byte: textSha256)
+		text << std::setw(2) << (int)byte;
+	text << "\ntext-crc32 " << std::setw(8) << textCrc32;
+	text << "\npayload-sha256 ";
+	for (uint8_t byte: payloadSha256)
+		text << std::setw(2) << (int)byte;
+	text << "\npayload-crc32 " << std::setw(8) << payloadCrc32 << "\n";
+	output << text.str();
 }
 
 
-void IntelHex::Cipher(const uint8_t* key, int len)
+/// Digests being computed, data is added to them in order.
+struct HexDigester {
+	HexDigester()
+		: textCrc32(0)
+		, payloadCrc32(0)
+	{
+		sha256_init(&textSha256);
+		sha256_init(&payloadSha256);
+	}
+
+	void AddText(const char* data, size_t length) {
+		sha256_update(&textSha256, data, length);
+		textCrc32 = crc32_update(textCrc32, (const uint8_t*)data, length);
+	}
+
+	void AddPayload(const uint8_t* data, size_t length) {
+		sha256_update(&payloadSha256, data, length);
+		payloadCrc32 = crc32_update(payloadCrc32, data, length);
+	}
+
+	void Finish(HexDigests& digests) {
+		sha256_final(&textSha256, digests.textSha256);
+		sha256_final(&payloadSha256, digests.payloadSha256);
+		digests.textCrc32 = textCrc32;
+		digests.payloadCrc32 = payloadCrc32;
+	}
+
+	sha256_context textSha256;
+	sha256_context payloadSha256;
+	uint32_t textCrc32;
+	uint32_t payloadCrc32;
+};
+
+
+/// Whether a file name stands for the standard input or output.
+static inline bool IsStandardStream(const char* filename)
 {
-	uint8_t state[256];
+	return strcmp(filename, "-") == 0;
+}
 
-	arcfour_key_setup(state, key, len);
 
-	// There is a known attack on ARC4 allowing to recover the key from:
-	// - An unencrypted message
-	// - The matching first 256 bytes of encrypted data
-	// Skipping the first 256 bytes of the keystream avoids this. Of course the
-	// decoder must do the same.
-	uint8_t stream[256];
-	arcfour_generate_stream(state, stream, 256);
+#ifdef HEXCRYPT_USE_MMAP
+/// Stream buffer reading from or writing to a file descriptor, with a large
+/// buffer. It is used for the standard input and output, where the C++ streams
+/// only have small buffers, or none if they are synchronized with stdio.
+/// The file descriptor is not closed.
+class FileStreamBuffer: public std::streambuf {
+	public:
+		FileStreamBuffer(int fd, size_t size = 1 << 20)
+			: fFD(fd)
+			, fBuffer(size)
+		{
+			setg(fBuffer.data(), fBuffer.data(), fBuffer.data());
+			setp(fBuffer.data(), fBuffer.data() + fBuffer.size());
+		}
 
-	for (auto& line: fData)
-	{
-		// Only cipher data lines, not extended addresses and other things.
-		if (line.type != 0)
-			continue;
+		~FileStreamBuffer() { sync(); }
 
-		arcfour_generate_stream(state, stream, line.data.size());
-		for(int i = 0; i < line.data.size(); i++) {
-			line.data[i] ^= stream[i];
+	protected:
+		int_type underflow() {
+			ssize_t got;
+			do {
+				got = read(fFD, fBuffer.data(), fBuffer.size());
+			} while (got < 0 && errno == EINTR);
+			if (got <= 0)
+				return traits_type::eof();
+
+			setg(fBuffer.data(), fBuffer.data(), fBuffer.data() + got);
+			return traits_type::to_int_type(*gptr());
 		}
-		line.UpdateChecksum();
-	}
+
+		int_type overflow(int_type c) {
+			if (sync() != 0)
+				return traits_type::eof();
+			if (!traits_type::eq_int_type(c, traits_type::eof())) {
+				*pptr() = traits_type::to_char_type(c);
+				pbump(1);
+			}
+			return traits_type::not_eof(c);
+		}
+
+		int sync() {
+			const char* pos = pbase();
+			while (pos < pptr()) {
+				ssize_t written = write(fFD, pos, pptr() - pos);
+				if (written < 0) {
+					if (errno == EINTR)
+						continue;
+					return -1;
+				}
+				pos += written;
+			}
+			setp(fBuffer.data(), fBuffer.data() + fBuffer.size());
+			return 0;
+		}
+
+	private:
+		int fFD;
+		std::vector<char> fBuffer;
+};
+#endif
+
+
+/// Read and write Intel hex format files.
+class IntelHex {
+	public:
+		bool Read(const char* filename);
+		bool Read(const char* data, size_t length);
+		bool Read(const char* filename, std::vector<ParseFailure>& failures,
+			bool all = false);
+		bool Read(const char* data, size_t length,
+			std::vector<ParseFailure>& failures, bool all = false);
+			// Report errors in failures instead of the standard error.
+			// @all go on after an error to find all of them.
+		bool Write(const char* filename);
+		bool Write(char* buffer, size_t length);
+
+		size_t GeneratedSize() const;
+			// Size of the output of Write, in bytes.
+		void SetDigests(bool enabled) { fDigests = enabled; }
+		const HexDigests& Digests() const { return fDigest; }
+			// SHA-256 and CRC-32 of the text and of the data computed by the
+			// last Write, if enabled.
+
+		bool ReadBinary(const char* filename, uint32_t base = 0);
+		bool ReadBinary(const uint8_t* data, size_t length, uint32_t base = 0);
+			// Raw image loaded at the base address, in 16-byte records.
+		bool WriteBinary(const char* filename, uint8_t fill = 0xFF);
+		void WriteBinary(std::vector<uint8_t>& output, uint8_t fill = 0xFF);
+			// Raw image from the lowest to the highest address, gaps filled.
+
+		bool ReadContainer(const char* filename);
+		bool ReadContainer(const uint8_t* data, size_t length);
+		bool WriteContainer(const char* filename, bool crc = true);
+		void WriteContainer(std::vector<uint8_t>& output, bool crc = true);
+			// Packed segments of data with their address, see below.
+
+		void SetFormat(const HexFormat& format) { fFormat = format; }
+			// Change the text generated by Write.
+		void SetThreads(unsigned threads, size_t chunk = 4096)
+			{ fThreads = threads; fChunk = chunk; }
+			// Read, Cipher and Write split the data in chunks of about this
+			// many records, run on this many threads. 1, the default, keeps
+			// everything on the calling thread.
+		void SetCache(const char* directory)
+			{ fCache = directory != NULL ? directory : ""; }
+			// Keep the parsed records of the Intel hex files read by name in
+			// this directory, and use them instead of parsing the same file
+			// again. Only on systems with mmap, NULL to disable.
+
+		void Cipher(const uint8_t* key, int len);
+		void Cipher(const CipherContext& context);
+		void Cipher(const CipherContext& context,
+			std::vector<AddressRange> ranges);
+			// ARC4 is symmetric, so this also deciphers.
+		void Cipher(const CipherEngine& engine);
+			// Cipher each record at its absolute address, in parallel if
+			// enabled. Not compatible with the ARC4 functions.
+		size_t Cipher(const CipherContext& context, const IntelHex& plain,
+			const IntelHex& ciphered);
+		void CipherCopies(const std::vector<const CipherContext*>& contexts,
+			std::vector<IntelHex>& copies);
+			// Copies of the data, each ciphered with one of the contexts.
+			// Same as Cipher(context), reusing the keystream of a previous
+			// build given as plain and ciphered data. Returns how many data
+			// records reused it.
+
+		void Repack(uint8_t length);
+			// Merge contiguous data records into records of the given length.
+
+		const AddressIndex& Index() const { return fIndex; }
+			// Data records by absolute address.
+		const uint8_t* DataAt(uint32_t address) const;
+			// The data byte at this absolute address, NULL if there is none.
+
+		std::vector<AddressRange> Diff(const IntelHex& old,
+			uint32_t block = 256) const;
+			// Addresses where the data differs from an older image, or isn't
+			// there, by address. Data only found in the old image is left
+			// out. Aligned blocks of the given size (up to kMaxDiffBlock) are
+			// compared by hash, and only those which differ byte by byte.
+		void Patch(const IntelHex& old, const IntelHex& updated,
+			uint32_t block = 256);
+			// Replace the records with those of the updated image with data
+			// where it differs from the old one, unchanged, and the extended
+			// address records they need.
+
+		static const uint32_t kMaxDiffBlock = 4096;
+
+		static bool Stream(const char* input, const char* output,
+			const uint8_t* key, int len, const HexFormat& format = HexFormat());
+		static bool Stream(const char* input, const char* output,
+			const CipherContext& context, const HexFormat& format = HexFormat(),
+			HexStats* stats = NULL);
+		static bool Stream(std::istream& input, std::ostream& output,
+			const CipherContext& context, const HexFormat& format,
+			std::string& error, HexStats* stats = NULL);
+			// Read, cipher and write one record at a time.
+			// The stream overload reports errors in error instead of the
+			// standard error.
+		static bool Verify(const char* plain, const char* ciphered,
+			const CipherContext& context, VerifyMismatch& mismatch);
+			// Check that a file deciphers to another, one record at a time.
+
+		bool operator==(const IntelHex& other) const;
+
+		const HexStats& Stats() const { return fStats; }
+		void ResetStats() { fStats.Reset(); }
+		void SetStatsListener(HexStatsListener* listener)
+			{ fStatsListener = listener; }
+			// Notified at the end of each Read, Cipher and Write.
+
+	private:
+		static ParseStatus ScanLine(const char* line, size_t length,
+			uint8_t buffer[512], int& column);
+		static HexRecord ParseLine(const char* line, size_t length, int l,
+			uint8_t buffer[512]) throw(ParseError);
+		static HexRecord ParseLine(std::istream& input, int l,
+			uint8_t buffer[512]) throw(std::ios_base::failure, ParseError);
+		static void StreamCipher(std::istream& input, std::ostream& output,
+			const CipherContext& context, const HexFormat& format,
+			HexStats& stats) throw(std::ios_base::failure, ParseError);
+
+		static bool LoadFile(const char* filename,
+			const std::function<bool(const char*, size_t)>& parse,
+			HexStats& stats, bool detect = false, uint8_t* digest = NULL,
+			const std::function<bool(DecompressStreamBuffer&)>& parseStream
+				= nullptr);
+		bool LoadCached(const char* filename,
+			const std::function<bool(const char*, size_t)>& parse,
+			const std::function<bool(DecompressStreamBuffer&)>& parseStream);
+#ifdef HEXCRYPT_USE_MMAP
+		struct CacheKey {
+			std::string path;
+				// Input file, resolved
+			std::string file;
+				// Cache file for it
+			uint64_t size;
+			int64_t mtime;
+			int64_t mtimeNanoseconds;
+		};
+		bool GetCacheKey(const char* filename, CacheKey& key) const;
+		bool ReadCache(const CacheKey& key);
+		void WriteCache(const CacheKey& key, const uint8_t digest[32]) const;
+#endif
+		static bool SaveFile(const char* filename, size_t length,
+			const std::function<void(char*)>& generate, HexStats& stats);
+
+		bool ParseBuffer(const char* data, size_t length);
+		struct ParsedLines {
+			std::vector<HexRecord> records;
+			std::vector<uint8_t> payload;
+			std::vector<ParseFailure> failures;
+				// Line numbers are counted from the start of the lines.
+			int lines;
+			bool ended;
+				// The end record was found.
+			bool failed;
+			bool stopped;
+				// Parsing stopped at an error.
+		};
+
+		static void ParseLines(const char* base, const char* data,
+			const char* end, bool all, ParsedLines& parsed);
+		bool Parse(const char* data, size_t length,
+			std::vector<ParseFailure>& failures, bool all);
+		bool ParseStream(DecompressStreamBuffer& input,
+			std::vector<ParseFailure>& failures, bool all, bool print);
+		bool ParseParallel(const char* data, size_t length,
+			std::vector<ParseFailure>& failures, bool all);
+		bool FinishParse(bool ended, bool failed, bool stopped, int lines,
+			std::vector<ParseFailure>& failures);
+		size_t Generate(char* output);
+		void DigestPayload(size_t first, size_t last,
+			HexDigester& digester) const;
+		void AppendData(uint64_t address, const uint8_t* data, size_t length,
+			uint32_t& extended);
+		void CopyData(uint8_t* output, const std::vector<AddressRange>& areas,
+			const std::vector<size_t>& offsets) const;
+		size_t ContainerSize(bool crc) const;
+		void GenerateContainer(uint8_t* output, bool crc) const;
+		void CipherRecords(uint8_t state[256], size_t first, size_t last,
+			HexStats& stats);
+		bool Parallel() const
+			{ return fThreads > 1 && fData.size() > fChunk; }
+		size_t ParseChunkSize() const { return fChunk * 64; }
+			// In bytes, about as many lines as records in a chunk.
+		void RunChunks(
+			const std::function<void(size_t, size_t, HexStats&)>& work);
+		void BuildIndex();
+		struct BlockHash {
+			uint64_t block;
+				// Address divided by the block size
+			uint64_t hash;
+		};
+		void HashBlocks(uint32_t block, std::vector<BlockHash>& hashes) const;
+		void WriteRecord(std::ostream& output, const uint8_t type, const uint16_t address,
+			const std::vector<uint8_t> data) throw(std::ios_base::failure);
+
+		std::vector<HexRecord> fData;
+		std::vector<uint8_t> fPayload;
+			// Data bytes of all the records, one after the other.
+		AddressIndex fIndex;
+		HexFormat fFormat;
+		unsigned fThreads = 1;
+		size_t fChunk = 4096;
+		bool fDigests = false;
+		HexDigests fDigest;
+		std::string fCache;
+			// Directory of the parsed image cache, empty if disabled
+
+		HexStats fStats;
+		HexStatsListener* fStatsListener = NULL;
+};
+
+
+/// Read and parse an intel ihex file
+/// @filename name of the file to read
+/// @returns true on success, false on error.
+bool IntelHex::Read(const char* filename)
+{
+	HEXSTATS_PHASE(fStats, readTime, fStatsListener, "read");
+	std::vector<ParseFailure> failures;
+	return LoadCached(filename, [this](const char* data, size_t length) {
+		return ParseBuffer(data, length);
+	}, [&](DecompressStreamBuffer& input) {
+		return ParseStream(input, failures, false, true);
+	});
+}
+
+
+/// Mix a word into a hash. Fast, to detect changes, not deliberate
+/// collisions.
+static inline uint64_t hash_mix(uint64_t hash, uint64_t word)
+{
+	hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+	return hash ^ (hash >> 29);
 }
+
+
+/// Hash of a whole file, to know if it changed. Four independent lanes of
+/// hash_mix go through 32 bytes at a time, several times faster than SHA-256.
+static void content_hash(const uint8_t* data, size_t length, uint8_t hash[32])
+{
+	uint64_t lanes[4] = { 0x243F6A8885A308D3ull, 0x13198A2E03707344ull,
+		0xA4093822299F31D0ull, 0x082EFA98EC4E6C89ull };
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t word;
+			memcpy(&word, data + i + 8 * l, 8);
+			lanes[l] = hash_mix(lanes[l], word);
+		}
+	}
+
+	uint8_t tail[32] = { 0 };
+	memcpy(tail, data + i, length - i);
+	for (int l = 0; l < 4; l++) {
+		uint64_t word;
+		memcpy(&word, tail + 8 * l, 8);
+		lanes[l] = hash_mix(hash_mix(lanes[l], word), length);
+	}
+	// Each lane of the result depends on all of them
+	for (int l = 0; l < 4; l++) {
+		uint64_t value = lanes[l];
+		for (int other = 1; other < 4; other++)
+			value = hash_mix(value, lanes[(l + other) % 4]);
+		memcpy(hash + 8 * l, &value, 8);
+	}
+}
+
+
+/// Give the contents of a file to a parsing function.
+/// Regular files are mapped in memory and parsed in place. Other files (pipes,
+/// devices) are read in a single buffer first.
+/// Files named .gz or .zst, or starting like them if detect is set, are
+/// decompressed in memory before parsing, or given to parseStream if set,
+/// which gets the data a block at a time.
+/// @digest if not NULL, set to the content_hash of the file as read,
+/// compressed or not.
+/// @returns the result of the parsing function, false if the file can't be
+/// read.
+bool IntelHex::LoadFile(const char* filename,
+	const std::function<bool(const char*, size_t)>& parse, HexStats& stats,
+	bool detect, uint8_t* digest,
+	const std::function<bool(DecompressStreamBuffer&)>& parseStream)
+{
+	auto hash = [&](const char* data, size_t length) {
+		if (digest != NULL)
+			content_hash((const uint8_t*)data, length, digest);
+	};
+
+	Compression byName = compression_of_name(filename);
+	auto decompress = [&](const char* data, size_t length) {
+		Compression type = byName;
+		if (type == kCompressionNone && detect)
+			type = compression_of_data((const uint8_t*)data, length);
+		if (type == kCompressionNone)
+			return parse(data, length);
+		if (parseStream) {
+			MemoryStreamBuffer source(data, length);
+			DecompressStreamBuffer decompressor(&source, type, false);
+			return parseStream(decompressor);
+		}
+
+		std::vector<char> plain;
+		const char* error;
+		HEXSTATS_ADD(stats, allocations, 1);
+		if (!decompress_buffer(type, data, length, plain, error)) {
+			std::cerr << "Can't decompress input file: " << error << std::endl;
+			return false;
+		}
+		return parse(plain.data(), plain.size());
+	};
+
+#ifdef HEXCRYPT_USE_MMAP
+	bool standard = IsStandardStream(filename);
+	int fd = standard ? STDIN_FILENO : open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Can't read input file: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	struct stat st;
+	if (!standard && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& st.st_size > 0) {
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			std::cerr << "Can't map input file: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		hash((const char*)map, st.st_size);
+		bool result = decompress((const char*)map, st.st_size);
+		munmap(map, st.st_size);
+		return result;
+	}
+
+	// Read directly at the end of the buffer, in large chunks
+	std::vector<char> contents;
+	HEXSTATS_ADD(stats, allocations, 1);
+	size_t used = 0;
+	while (true) {
+		if (contents.size() - used < (1 << 20))
+			contents.resize(std::max<size_t>(contents.size() * 2, 1 << 21));
+		ssize_t got = read(fd, contents.data() + used, contents.size() - used);
+		if (got == 0)
+			break;
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Can't read input file: " << strerror(errno) << std::endl;
+			if (!standard)
+				close(fd);
+			return false;
+		}
+		used += got;
+	}
+	contents.resize(used);
+	if (!standard)
+		close(fd);
+#else
+	std::ifstream file;
+	// Configure the object to throw exceptions, so we can catch them
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+	std::vector<char> contents;
+	HEXSTATS_ADD(stats, allocations, 1);
+	try {
+		if (IsStandardStream(filename)) {
+			contents.assign(std::istreambuf_iterator<char>(std::cin),
+				std::istreambuf_iterator<char>());
+		} else {
+			file.open(filename, std::ios::in | std::ios::binary);
+			contents.assign(std::istreambuf_iterator<char>(file),
+				std::istreambuf_iterator<char>());
+		}
+	} catch(std::ios_base::failure e) {
+		std::cerr << "Can't read input file: " << e.what() << std::endl;
+		return false;
+	}
+#endif
+
+	hash(contents.data(), contents.size());
+	return decompress(contents.data(), contents.size());
+}
+
+
+/// Load an Intel hex file from the cache if it has a valid entry for it, or
+/// parse it and add it to the cache.
+/// Compressed files are detected by their contents as well as their name,
+/// so a cache entry is valid for any reader of the file.
+/// See LoadFile for the parameters.
+bool IntelHex::LoadCached(const char* filename,
+	const std::function<bool(const char*, size_t)>& parse,
+	const std::function<bool(DecompressStreamBuffer&)>& parseStream)
+{
+#ifdef HEXCRYPT_USE_MMAP
+	CacheKey key;
+	if (!fCache.empty() && GetCacheKey(filename, key)) {
+		if (ReadCache(key))
+			return true;
+
+		uint8_t digest[32];
+		if (!LoadFile(filename, parse, fStats, true, digest, parseStream))
+			return false;
+		WriteCache(key, digest);
+		return true;
+	}
+#endif
+	return LoadFile(filename, parse, fStats, true, NULL, parseStream);
+}
+
+
+#ifdef HEXCRYPT_USE_MMAP
+/// Layout of a cache file. The sections follow the header in this order,
+/// each padded to 8 bytes: the input path, the records, the payload, then the
+/// entries, segments and overlaps of the address index. The data is stored as
+/// it is in memory, so the records are only loaded by the same build.
+struct ImageCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+		// kImageCacheByteOrder, as written by this machine
+	uint32_t recordSize;
+	uint32_t entrySize;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtimeNanoseconds;
+	uint8_t contents[32];
+		// content_hash of the whole input file
+	uint64_t pathLength;
+	uint64_t records;
+	uint64_t payload;
+	uint64_t entries;
+	uint64_t segments;
+	uint64_t overlaps;
+};
+
+
+static const char kImageCacheMagic[8] = { 'H', 'E', 'X', 'C', 'A', 'C', 'H',
+	'E' };
+static const uint32_t kImageCacheVersion = 1;
+static const uint32_t kImageCacheByteOrder = 0x01020304;
+
+
+static inline uint64_t cache_padded(uint64_t size)
+{
+	return (size + 7) & ~(uint64_t)7;
+}
+
+
+/// Where an input file is cached, and what must match for the cache to be
+/// used. Only regular files have one.
+bool IntelHex::GetCacheKey(const char* filename, CacheKey& key) const
+{
+	if (IsStandardStream(filename))
+		return false;
+	char* resolved = realpath(filename, NULL);
+	if (resolved == NULL)
+		return false;
+	key.path = resolved;
+	free(resolved);
+
+	struct stat st;
+	if (stat(key.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	key.size = st.st_size;
+	key.mtime = st.st_mtime;
+#ifdef __APPLE__
+	key.mtimeNanoseconds = st.st_mtimespec.tv_nsec;
+#else
+	key.mtimeNanoseconds = st.st_mtim.tv_nsec;
+#endif
+
+	// Named from a hash of the path, which is also stored to check it
+	uint8_t digest[32];
+	sha256_context context;
+	sha256_init(&context);
+	sha256_update(&context, key.path.data(), key.path.size());
+	sha256_final(&context, digest);
+	std::ostringstream name;
+	name << fCache << '/' << std::hex << std::setfill('0');
+	for (int i = 0; i < 16; i++)
+		name << std::setw(2) << (int)digest[i];
+	name << ".hxp";
+	key.file = name.str();
+	return true;
+}
+
+
+/// Read the whole file at once, instead of a page fault for each page.
+#ifdef MAP_POPULATE
+static const int kMapWhole = MAP_POPULATE;
+#else
+static const int kMapWhole = 0;
+#endif
+
+
+/// content_hash of a whole file.
+static bool file_digest(const char* filename, uint64_t size, uint8_t digest[32])
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	void* map = size > 0
+		? mmap(NULL, size, PROT_READ, MAP_PRIVATE | kMapWhole, fd, 0) : NULL;
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	content_hash((const uint8_t*)map, size, digest);
+	if (map != NULL)
+		munmap(map, size);
+	return true;
+}
+
+
+/// Load the records and index from the cache file, if it is for the same
+/// input: same path, size, modification time and contents.
+/// @returns false if there is no such cache file, the image is unchanged then.
+/// Check the records and index entries loaded from a cache file.
+/// @returns false if a record is out of the payload or an entry names a
+/// record which doesn't exist or is smaller than it.
+static bool cache_records_valid(const std::vector<HexRecord>& records,
+	uint64_t payload, const AddressIndex::Entry* entries, uint64_t count)
+{
+	for (const HexRecord& record: records) {
+		if (record.Offset() > payload
+				|| payload - record.Offset() < record.Size()
+				|| record.type > 5
+				|| ((record.type == 2 || record.type == 4)
+					&& !record.IsExtendedAddress()))
+			return false;
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		if (entries[i].record >= records.size()
+				|| entries[i].size > records[entries[i].record].Size())
+			return false;
+	}
+	return true;
+}
+
+
+bool IntelHex::ReadCache(const CacheKey& key)
+{
+	int fd = open(key.file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageCacheHeader)) {
+		close(fd);
+		return false;
+	}
+	uint64_t length = st.st_size;
+	void* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE | kMapWhole, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const ImageCacheHeader* header = (const ImageCacheHeader*)map;
+	const char* data = (const char*)map + sizeof(ImageCacheHeader);
+	bool valid = memcmp(header->magic, kImageCacheMagic, 8) == 0
+		&& header->version == kImageCacheVersion
+		&& header->byteOrder == kImageCacheByteOrder
+		&& header->recordSize == sizeof(HexRecord)
+		&& header->entrySize == sizeof(AddressIndex::Entry)
+		&& header->size == key.size && header->mtime == key.mtime
+		&& header->mtimeNanoseconds == key.mtimeNanoseconds
+		&& header->pathLength == key.path.size()
+		&& header->records <= length && header->payload <= length
+		&& header->entries <= length && header->segments <= length
+		&& header->overlaps <= length
+		&& sizeof(ImageCacheHeader) + cache_padded(header->pathLength)
+			+ cache_padded(header->records * sizeof(HexRecord))
+			+ cache_padded(header->payload)
+			+ cache_padded(header->entries * sizeof(AddressIndex::Entry))
+			+ cache_padded(header->segments * sizeof(AddressRange))
+			+ cache_padded(header->overlaps * sizeof(AddressRange)) == length
+		&& memcmp(data, key.path.data(), key.path.size()) == 0;
+
+	// The time and size can stay the same when a file is changed quickly
+	uint8_t digest[32];
+	valid = valid && file_digest(key.path.c_str(), key.size, digest)
+		&& memcmp(digest, header->contents, 32) == 0;
+
+	if (valid) {
+		data += cache_padded(header->pathLength);
+		const HexRecord* records = (const HexRecord*)data;
+		fData.assign(records, records + header->records);
+		data += cache_padded(header->records * sizeof(HexRecord));
+		fPayload.assign(data, data + header->payload);
+		data += cache_padded(header->payload);
+
+		const AddressIndex::Entry* entries = (const AddressIndex::Entry*)data;
+		data += cache_padded(header->entries * sizeof(AddressIndex::Entry));
+		const AddressRange* segments = (const AddressRange*)data;
+		data += cache_padded(header->segments * sizeof(AddressRange));
+		const AddressRange* overlaps = (const AddressRange*)data;
+
+		// The digest comes from the cache file too, so it doesn't tell if the
+		// file can be trusted. The records are only used if they can't make
+		// the rest of IntelHex read out of the payload.
+		valid = cache_records_valid(fData, header->payload, entries,
+			header->entries);
+		if (valid) {
+			fIndex.Load(entries, header->entries, segments, header->segments,
+				overlaps, header->overlaps);
+			HEXSTATS_ADD(fStats, allocations, 5);
+		} else {
+			fData.clear();
+			fPayload.clear();
+		}
+	}
+
+	munmap(map, length);
+	return valid;
+}
+
+
+/// Save the records and index of the file just parsed. The cache is written
+/// to a temporary file which replaces the old one, so readers never see a
+/// partial one. Errors are ignored, the file is just parsed again next time.
+void IntelHex::WriteCache(const CacheKey& key, const uint8_t digest[32]) const
+{
+	ImageCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kImageCacheMagic, 8);
+	header.version = kImageCacheVersion;
+	header.byteOrder = kImageCacheByteOrder;
+	header.recordSize = sizeof(HexRecord);
+	header.entrySize = sizeof(AddressIndex::Entry);
+	header.size = key.size;
+	header.mtime = key.mtime;
+	header.mtimeNanoseconds = key.mtimeNanoseconds;
+	memcpy(header.contents, digest, 32);
+	header.pathLength = key.path.size();
+	header.records = fData.size();
+	header.payload = fPayload.size();
+	header.entries = fIndex.Entries().size();
+	header.segments = fIndex.Segments().size();
+	header.overlaps = fIndex.Overlaps().size();
+
+	mkdir(fCache.c_str(), 0777);
+	std::ostringstream temporary;
+	temporary << key.file << "." << getpid() << ".tmp";
+	std::string name = temporary.str();
+	std::ofstream output(name.c_str(), std::ios::out | std::ios::binary);
+
+	const char padding[8] = { 0 };
+	auto section = [&](const void* data, uint64_t size) {
+		output.write((const char*)data, size);
+		output.write(padding, cache_padded(size) - size);
+	};
+	section(&header, sizeof(header));
+	section(key.path.data(), key.path.size());
+	section(fData.data(), fData.size() * sizeof(HexRecord));
+	section(fPayload.data(), fPayload.size());
+	section(fIndex.Entries().data(),
+		fIndex.Entries().size() * sizeof(AddressIndex::Entry));
+	section(fIndex.Segments().data(),
+		fIndex.Segments().size() * sizeof(AddressRange));
+	section(fIndex.Overlaps().data(),
+		fIndex.Overlaps().size() * sizeof(AddressRange));
+	output.close();
+
+	if (!output || rename(name.c_str(), key.file.c_str()) != 0)
+		unlink(name.c_str());
+}
+#endif
+
+
+/// Parse intel ihex data from a memory buffer.
+/// @data the file contents, need not be NULL terminated.
+/// @length size of the data, in bytes.
+/// @returns true on success, false on error.
+bool IntelHex::Read(const char* data, size_t length)
+{
+	HEXSTATS_PHASE(fStats, readTime, fStatsListener, "read");
+	return ParseBuffer(data, length);
+}
+
+
+/// Read and parse an intel ihex file, without printing errors.
+/// Nothing is thrown, and the failures only hold the error locations. The
+/// file is gone once this returns, so they can't give the text of the line.
+/// @failures the errors are added there.
+/// @all report all the errors instead of stopping at the first one.
+/// @returns true on success, false on error.
+bool IntelHex::Read(const char* filename, std::vector<ParseFailure>& failures,
+	bool all)
+{
+	HEXSTATS_PHASE(fStats, readTime, fStatsListener, "read");
+	return LoadCached(filename, [&](const char* data, size_t length) {
+		return Parse(data, length, failures, all);
+	}, [&](DecompressStreamBuffer& input) {
+		return ParseStream(input, failures, all, false);
+	});
+}
+
+
+/// Parse intel ihex data from a memory buffer, without printing errors.
+/// failures[i].Message(data) gives the same text as Read would print.
+bool IntelHex::Read(const char* data, size_t length,
+	std::vector<ParseFailure>& failures, bool all)
+{
+	HEXSTATS_PHASE(fStats, readTime, fStatsListener, "read");
+	return Parse(data, length, failures, all);
+}
+
+
+/// Parse a memory buffer, and report errors.
+bool IntelHex::ParseBuffer(const char* data, size_t length)
+{
+	std::vector<ParseFailure> failures;
+	if (Parse(data, length, failures, false))
+		return true;
+
+	std::cerr << failures[0].Message(data) << std::endl;
+	return false;
+}
+
+
+/// Write the data to an ihex file.
+bool IntelHex::Write(const char* filename)
+{
+	HEXSTATS_PHASE(fStats, writeTime, fStatsListener, "write");
+	return SaveFile(filename, GeneratedSize(), [this](char* output) {
+		Generate(output);
+	}, fStats);
+}
+
+
+#ifdef HEXCRYPT_USE_MMAP
+/// Allocate the blocks of a file, so writing to a mapping of it can't fail
+/// for lack of space, which would only be reported as a SIGBUS.
+/// @returns false if they can't be allocated, the file must then be written
+/// without mapping it.
+static bool file_allocate(int fd, size_t length)
+{
+#ifdef __APPLE__
+	(void)fd;
+	(void)length;
+	return false;
+#else
+	return posix_fallocate(fd, 0, length) == 0;
+#endif
+}
+#endif
+
+
+/// Create a file and fill it with a generating function.
+/// The output size is known in advance, so the file is allocated, mapped and
+/// filled in place. When it can't be (pipes, devices, no space), the data is
+/// generated in a single buffer which is written at once.
+/// Files named .gz or .zst are generated in memory, then compressed as they
+/// are written.
+/// @generate called once with room for length bytes.
+bool IntelHex::SaveFile(const char* filename, size_t length,
+	const std::function<void(char*)>& generate, HexStats& stats)
+{
+	Compression compression = compression_of_name(filename);
+	if (compression != kCompressionNone) {
+		const char* unsupported = compression_unsupported(compression);
+		if (unsupported != NULL) {
+			std::cerr << "Can't write output file: " << unsupported << std::endl;
+			return false;
+		}
+
+		std::vector<char> buffer(length);
+		HEXSTATS_ADD(stats, allocations, 1);
+		generate(buffer.data());
+
+		std::filebuf file;
+		if (file.open(filename, std::ios::out | std::ios::binary) == NULL) {
+			std::cerr << "Can't write output file: " << strerror(errno)
+				<< std::endl;
+			return false;
+		}
+		CompressStreamBuffer compressor(&file, compression);
+		compressor.sputn(buffer.data(), length);
+		if (!compressor.Finish() || file.close() == NULL) {
+			std::cerr << "Can't write output file: " << (compressor.Error()
+				? compressor.Error() : strerror(errno)) << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+#ifdef HEXCRYPT_USE_MMAP
+	bool standard = IsStandardStream(filename);
+	int fd = standard ? STDOUT_FILENO
+		: open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		std::cerr << "Can't write output file: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if (!standard && length > 0 && file_allocate(fd, length)) {
+		void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			generate((char*)map);
+			// Write errors of a mapping are only reported here
+			int error = msync(map, length, MS_SYNC) != 0 ? errno : 0;
+			if (munmap(map, length) != 0 && error == 0)
+				error = errno;
+			if (close(fd) != 0 && error == 0)
+				error = errno;
+			if (error != 0) {
+				std::cerr << "Can't write output file: " << strerror(error)
+					<< std::endl;
+				return false;
+			}
+			return true;
+		}
+	}
+
+	std::vector<char> buffer(length);
+	HEXSTATS_ADD(stats, allocations, 1);
+	generate(buffer.data());
+
+	const char* pos = buffer.data();
+	while (length > 0) {
+		ssize_t written = write(fd, pos, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Can't write output file: " << strerror(errno) << std::endl;
+			if (!standard)
+				close(fd);
+			return false;
+		}
+		pos += written;
+		length -= written;
+	}
+
+	if (!standard && close(fd) != 0) {
+		std::cerr << "Can't write output file: " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+#else
+	std::ofstream file;
+	// Configure the object to throw exceptions, so we can catch them
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+	std::vector<char> buffer(length);
+	HEXSTATS_ADD(stats, allocations, 1);
+	generate(buffer.data());
+
+	try {
+		if (IsStandardStream(filename)) {
+			std::cout.write(buffer.data(), length);
+			std::cout.flush();
+			return std::cout.good();
+		}
+		file.open(filename, std::ios::out | std::ios::binary);
+		file.write(buffer.data(), length);
+		return true;
+	} catch(std::ios_base::failure e) {
+		std::cerr << "Can't write output file: " << e.what() << std::endl;
+		return false;
+	}
+#endif
+}
+
+
+/// Generate ihex data into a memory buffer.
+/// @buffer where to write the data.
+/// @length size of the buffer, at least GeneratedSize() bytes.
+/// @returns true on success, false if the buffer is too small.
+bool IntelHex::Write(char* buffer, size_t length)
+{
+	HEXSTATS_PHASE(fStats, writeTime, fStatsListener, "write");
+	if (length < GeneratedSize())
+		return false;
+
+	Generate(buffer);
+	return true;
+}
+
+
+size_t IntelHex::GeneratedSize() const
+{
+	size_t length = 0;
+	for (const auto& line: fData)
+		length += line.GeneratedSize(fFormat);
+	return length;
+}
+
+
+/// Read a raw binary image.
+/// @base the absolute address of the first byte.
+/// @returns true on success, false on error.
+bool IntelHex::ReadBinary(const char* filename, uint32_t base)
+{
+	HEXSTATS_PHASE(fStats, readTime, fStatsListener, "read");
+	return LoadFile(filename, [this, base](const char* data, size_t length) {
+		return ReadBinary((const uint8_t*)data, length, base);
+	}, fStats);
+}
+
+
+bool IntelHex::ReadBinary(const uint8_t* data, size_t length, uint32_t base)
+{
+	if (length > (uint64_t)UINT32_MAX + 1 - base) {
+		std::cerr << "Binary image doesn't fit in 32-bit addresses" << std::endl;
+		return false;
+	}
+	// Leave room for the extended address records in the payload
+	if (length > UINT32_MAX - 0x40000) {
+		std::cerr << "Binary image too large" << std::endl;
+		return false;
+	}
+
+	fData.clear();
+	fPayload.clear();
+	fData.reserve(length / 16 + length / 65536 + 3);
+	fPayload.reserve(length + length / 65536 * 2 + 4);
+	HEXSTATS_ADD(fStats, allocations, 2);
+
+	uint32_t extended = 0;
+	AppendData(base, data, length, extended);
+	fData.push_back(HexRecord(1, 0, 0, NULL, fPayload.size()));
+	HEXSTATS_ADD(fStats, lines, fData.size());
+	BuildIndex();
+	return true;
+}
+
+
+/// Add data records for a block of data, with the extended linear address
+/// records needed before them. Records never cross a 64K boundary.
+/// @extended the current extended address, updated when a record is added.
+void IntelHex::AppendData(uint64_t address, const uint8_t* data, size_t length,
+	uint32_t& extended)
+{
+	while (length > 0) {
+		if ((address & ~0xFFFFull) != extended) {
+			extended = address & ~0xFFFFull;
+			uint8_t value[2] = { (uint8_t)(extended >> 24),
+				(uint8_t)(extended >> 16) };
+			fData.push_back(HexRecord(4, 0, 2, value, fPayload.size()));
+			fPayload.insert(fPayload.end(), value, value + 2);
+		}
+
+		size_t size = length < 16 ? length : 16;
+		if ((address & 0xFFFF) + size > 0x10000)
+			size = 0x10000 - (address & 0xFFFF);
+		fData.push_back(HexRecord(0, (uint16_t)address, size, data,
+			fPayload.size()));
+		fPayload.insert(fPayload.end(), data, data + size);
+
+		address += size;
+		data += size;
+		length -= size;
+	}
+}
+
+
+/// Copy the data of all records to an output buffer.
+/// Records are copied in file order, so where they overlap the last one wins.
+/// @areas address ranges, in order, which together contain all the data.
+/// @offsets where each area starts in the output.
+void IntelHex::CopyData(uint8_t* output, const std::vector<AddressRange>& areas,
+	const std::vector<size_t>& offsets) const
+{
+	uint32_t extended = 0;
+	for (const auto& line: fData) {
+		const uint8_t* payload = fPayload.data() + line.Offset();
+		if (line.IsExtendedAddress())
+			extended = line.ExtendedAddress(payload);
+		if (line.type != 0 || line.Size() == 0)
+			continue;
+
+		uint64_t start = (uint64_t)extended + line.Address();
+		auto area = std::upper_bound(areas.begin(), areas.end(), start,
+			[](uint64_t address, const AddressRange& area) {
+				return address < area.end;
+			});
+		memcpy(output + offsets[area - areas.begin()] + (start - area->start),
+			payload, line.Size());
+	}
+}
+
+
+/// Write the data as a raw binary image.
+/// The image starts at the lowest address with data, which is not stored.
+/// Gaps between records are filled.
+/// @returns true on success, false on error.
+bool IntelHex::WriteBinary(const char* filename, uint8_t fill)
+{
+	HEXSTATS_PHASE(fStats, writeTime, fStatsListener, "write");
+	const std::vector<AddressRange>& segments = fIndex.Segments();
+	size_t length = segments.empty() ? 0
+		: segments.back().end - segments.front().start;
+
+	HEXSTATS_ADD(fStats, bytesWritten, length);
+	return SaveFile(filename, length, [&](char* output) {
+		memset(output, fill, length);
+		if (length > 0) {
+			CopyData((uint8_t*)output, std::vector<AddressRange>(1,
+				AddressRange(segments.front().start, segments.back().end)),
+				std::vector<size_t>(1, 0));
+		}
+	}, fStats);
+}
+
+
+void IntelHex::WriteBinary(std::vector<uint8_t>& output, uint8_t fill)
+{
+	HEXSTATS_PHASE(fStats, writeTime, fStatsListener, "write");
+	const std::vector<AddressRange>& segments = fIndex.Segments();
+	output.assign(segments.empty() ? 0
+		: segments.back().end - segments.front().start, fill);
+	HEXSTATS_ADD(fStats, bytesWritten, output.size());
+	if (!output.empty()) {
+		CopyData(output.data(), std::vector<AddressRange>(1,
+			AddressRange(segments.front().start, segments.back().end)),
+			std::vector<size_t>(1, 0));
+	}
+}
+
+
+/// The container stores the segments of contiguous data, without the record
+/// layout. All numbers are 32-bit little endian:
+/// - "HXC1"
+/// - flags, bit 0 set if there is a CRC
+/// - number of segments
+/// - for each segment, in address order: absolute address, length, data
+/// - if flagged, CRC-32 of everything before it
+static const char kContainerMagic[4] = { 'H', 'X', 'C', '1' };
+static const uint32_t kContainerCRC = 1;
+
+
+static inline void put_le32(uint8_t* out, uint32_t value)
+{
+	out[0] = value;
+	out[1] = value >> 8;
+	out[2] = value >> 16;
+	out[3] = value >> 24;
+}
+
+
+static inline uint32_t get_le32(const uint8_t* in)
+{
+	return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+
+size_t IntelHex::ContainerSize(bool crc) const
+{
+	size_t length = 12 + (crc ? 4 : 0);
+	for (const AddressRange& segment: fIndex.Segments())
+		length += 8 + segment.Size();
+	return length;
+}
+
+
+void IntelHex::GenerateContainer(uint8_t* output, bool crc) const
+{
+	const std::vector<AddressRange>& segments = fIndex.Segments();
+	uint8_t* start = output;
+	memcpy(output, kContainerMagic, 4);
+	put_le32(output + 4, crc ? kContainerCRC : 0);
+	put_le32(output + 8, segments.size());
+	output += 12;
+
+	std::vector<size_t> offsets;
+	offsets.reserve(segments.size());
+	for (const AddressRange& segment: segments) {
+		put_le32(output, segment.start);
+		put_le32(output + 4, segment.Size());
+		output += 8;
+		offsets.push_back(output - start);
+		output += segment.Size();
+	}
+	CopyData(start, segments, offsets);
+
+	if (crc)
+		put_le32(output, crc32_update(0, start, output - start));
+}
+
+
+/// Write the data in the packed container format.
+/// @crc whether to add a CRC-32 of the contents at the end.
+/// @returns true on success, false on error.
+bool IntelHex::WriteContainer(const char* filename, bool crc)
+{
+	HEXSTATS_PHASE(fStats, writeTime, fStatsListener, "write");
+	size_t length = ContainerSize(crc);
+	HEXSTATS_ADD(fStats, bytesWritten, length);
+	return SaveFile(filename, length, [this, crc](char* output) {
+		GenerateContainer((uint8_t*)output, crc);
+	}, fStats);
+}
+
+
+void IntelHex::WriteContainer(std::vector<uint8_t>& output, bool crc)
+{
+	HEXSTATS_PHASE(fStats, writeTime, fStatsListener, "write");
+	output.resize(ContainerSize(crc));
+	HEXSTATS_ADD(fStats, bytesWritten, output.size());
+	GenerateContainer(output.data(), crc);
+}
+
+
+/// Read a file in the packed container format.
+/// Each segment is split in 16-byte records.
+/// @returns true on success, false on error.
+bool IntelHex::ReadContainer(const char* filename)
+{
+	HEXSTATS_PHASE(fStats, readTime, fStatsListener, "read");
+	return LoadFile(filename, [this](const char* data, size_t length) {
+		return ReadContainer((const uint8_t*)data, length);
+	}, fStats);
+}
+
+
+bool IntelHex::ReadContainer(const uint8_t* data, size_t length)
+{
+	if (length < 12 || memcmp(data, kContainerMagic, 4) != 0) {
+		std::cerr << "Not a hexcrypt container" << std::endl;
+		return false;
+	}
+	if (length > UINT32_MAX - 0x40000) {
+		std::cerr << "Container too large" << std::endl;
+		return false;
+	}
+
+	uint32_t flags = get_le32(data + 4);
+	if ((flags & ~kContainerCRC) != 0) {
+		std::cerr << "Unknown container flags " << flags << std::endl;
+		return false;
+	}
+	if (flags & kContainerCRC) {
+		if (length < 16
+			|| crc32_update(0, data, length - 4) != get_le32(data + length - 4)) {
+			std::cerr << "Container CRC mismatch" << std::endl;
+			return false;
+		}
+		length -= 4;
+	}
+
+	// Check the layout before building anything
+	uint32_t count = get_le32(data + 8);
+	size_t pos = 12;
+	uint64_t last = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (length - pos < 8) {
+			std::cerr << "Truncated container" << std::endl;
+			return false;
+		}
+		uint64_t address = get_le32(data + pos);
+		uint32_t size = get_le32(data + pos + 4);
+		if (size > length - pos - 8) {
+			std::cerr << "Truncated container" << std::endl;
+			return false;
+		}
+		if (address < last || address + size > (uint64_t)UINT32_MAX + 1) {
+			std::cerr << "Invalid container segment " << i << std::endl;
+			return false;
+		}
+		last = address + size;
+		pos += 8 + size;
+	}
+	if (pos != length) {
+		std::cerr << "Unexpected data at end of container" << std::endl;
+		return false;
+	}
+
+	fData.clear();
+	fPayload.clear();
+	fData.reserve(length / 16 + 3);
+	fPayload.reserve(length);
+	HEXSTATS_ADD(fStats, allocations, 2);
+
+	uint32_t extended = 0;
+	pos = 12;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t size = get_le32(data + pos + 4);
+		AppendData(get_le32(data + pos), data + pos + 8, size, extended);
+		pos += 8 + size;
+	}
+	fData.push_back(HexRecord(1, 0, 0, NULL, fPayload.size()));
+	HEXSTATS_ADD(fStats, lines, fData.size());
+	BuildIndex();
+	return true;
+}
+
+
+/// Read, cipher and write an intel ihex file in a single pass.
+/// Only one record is held in memory at a time, and the output is identical to
+/// what Read, Cipher and Write would produce.
+/// @returns true on success, false on error.
+bool IntelHex::Stream(const char* input, const char* output,
+	const uint8_t* key, int len, const HexFormat& format)
+{
+	return Stream(input, output, CipherContext(key, len), format);
+}
+
+
+/// @stats if not NULL, the statistics are added there.
+bool IntelHex::Stream(const char* input, const char* output,
+	const CipherContext& context, const HexFormat& format, HexStats* stats)
+{
+	// "-" is the standard input or output, with large buffers when possible
+#ifdef HEXCRYPT_USE_MMAP
+	std::unique_ptr<FileStreamBuffer> inBuffer;
+	std::unique_ptr<FileStreamBuffer> outBuffer;
+#endif
+	std::ifstream inFile;
+	std::ofstream outFile;
+	std::istream in(NULL);
+	std::ostream out(NULL);
+	std::unique_ptr<DecompressStreamBuffer> decompressor;
+	std::unique_ptr<CompressStreamBuffer> compressor;
+
+	if (IsStandardStream(input)) {
+#ifdef HEXCRYPT_USE_MMAP
+		inBuffer.reset(new FileStreamBuffer(STDIN_FILENO));
+		in.rdbuf(inBuffer.get());
+#else
+		in.rdbuf(std::cin.rdbuf());
+#endif
+	} else {
+		inFile.open(input);
+		if (!inFile.is_open()) {
+			std::cerr << "Can't read input file: " << strerror(errno) << std::endl;
+			return false;
+		}
+		in.rdbuf(inFile.rdbuf());
+	}
+
+	if (IsStandardStream(output)) {
+#ifdef HEXCRYPT_USE_MMAP
+		outBuffer.reset(new FileStreamBuffer(STDOUT_FILENO));
+		out.rdbuf(outBuffer.get());
+#else
+		out.rdbuf(std::cout.rdbuf());
+#endif
+	} else {
+		outFile.open(output);
+		if (!outFile.is_open()) {
+			std::cerr << "Can't write output file: " << strerror(errno)
+				<< std::endl;
+			return false;
+		}
+		out.rdbuf(outFile.rdbuf());
+	}
+
+	// Compressed input is found from its first bytes, output from its name
+	decompressor.reset(new DecompressStreamBuffer(in.rdbuf()));
+	in.rdbuf(decompressor.get());
+	Compression compression = compression_of_name(output);
+	if (compression != kCompressionNone) {
+		compressor.reset(new CompressStreamBuffer(out.rdbuf(), compression));
+		out.rdbuf(compressor.get());
+	}
+
+	// The input is read ahead and the output written behind on threads of
+	// their own, with the compression, while this one parses and ciphers.
+	// The standard input is already a pipe, and reading it can block forever.
+	std::unique_ptr<ReadAheadStreamBuffer> readAhead;
+	if (!IsStandardStream(input)) {
+		readAhead.reset(new ReadAheadStreamBuffer(in.rdbuf()));
+		in.rdbuf(readAhead.get());
+	}
+	WriteBehindStreamBuffer writeBehind(out.rdbuf());
+	out.rdbuf(&writeBehind);
+
+	std::string error;
+	bool result = Stream(in, out, context, format, error, stats);
+	readAhead.reset();
+	if (!writeBehind.Finish() && result) {
+		error = "Can't write output file";
+		result = false;
+	}
+	if (compressor && !compressor->Finish()) {
+		error = std::string("Can't write output file: ") + compressor->Error();
+		result = false;
+	}
+	if (decompressor->Error() != NULL) {
+		error = std::string("Can't decompress input file: ")
+			+ decompressor->Error();
+	}
+	if (!result) {
+		std::cerr << error << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+/// The streams are configured to throw exceptions on errors.
+bool IntelHex::Stream(std::istream& input, std::ostream& output,
+	const CipherContext& context, const HexFormat& format, std::string& error,
+	HexStats* stats)
+{
+	HexStats local;
+	if (stats == NULL)
+		stats = &local;
+	HEXSTATS_PHASE(*stats, readTime, NULL, "stream");
+
+	// Configure the streams to throw exceptions, so we can catch them
+	input.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	output.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+	try {
+		StreamCipher(input, output, context, format, *stats);
+		output.flush();
+		return true;
+	} catch(std::ios_base::failure e) {
+		error = std::string("Can't stream file: ") + e.what();
+		return false;
+	} catch(ParseError e) {
+		error = e.what();
+		return false;
+	}
+}
+
+
+/// Check that a ciphered file deciphers to a plain one, without loading them.
+/// Both files are read side by side, one record at a time, and every record
+/// is compared with its payload. This stops at the first difference.
+/// @mismatch where the first difference is, if any.
+/// @returns true if the files match. Errors reading or parsing the files are
+/// printed on the standard error, with mismatch.reason left to NULL.
+bool IntelHex::Verify(const char* plain, const char* ciphered,
+	const CipherContext& context, VerifyMismatch& mismatch)
+{
+	mismatch = VerifyMismatch();
+
+	std::ifstream plainFile;
+	std::ifstream cipheredFile;
+	// Configure the objects to throw exceptions, so we can catch them
+	plainFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	cipheredFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	try {
+		plainFile.open(plain, std::ios::in | std::ios::binary);
+		cipheredFile.open(ciphered, std::ios::in | std::ios::binary);
+	} catch(std::ios_base::failure e) {
+		std::cerr << "Can't read input file: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	// Either file may be compressed
+	DecompressStreamBuffer plainBuffer(plainFile.rdbuf());
+	DecompressStreamBuffer cipheredBuffer(cipheredFile.rdbuf());
+	std::istream plainStream(&plainBuffer);
+	std::istream cipheredStream(&cipheredBuffer);
+	plainStream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	cipheredStream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+	uint8_t state[256];
+	context.CopyState(state);
+	uint8_t expected[512];
+	uint8_t found[512];
+	uint32_t extended = 0;
+
+	try {
+		for (int l = 1; true; l++) {
+			mismatch.line = l;
+			HexRecord p = ParseLine(plainStream, l, expected);
+			HexRecord c = ParseLine(cipheredStream, l, found);
+			mismatch.address = (uint64_t)extended + p.Address();
+
+			if (p.type != c.type) {
+				mismatch.reason = "different record type";
+				return false;
+			}
+			if (p.Address() != c.Address()) {
+				mismatch.reason = "different address";
+				return false;
+			}
+			if (p.Size() != c.Size()) {
+				mismatch.reason = "different length";
+				return false;
+			}
+
+			c.Cipher(state, found + 4);
+			for (int i = 0; i < p.Size(); i++) {
+				if (expected[i + 4] != found[i + 4]) {
+					mismatch.address += i;
+					mismatch.expected = expected[i + 4];
+					mismatch.found = found[i + 4];
+					mismatch.reason = "different data";
+					return false;
+				}
+			}
+
+			if (p.IsExtendedAddress())
+				extended = p.ExtendedAddress(expected + 4);
+			if (p.type == 1)
+				return true;
+		}
+	} catch(std::ios_base::failure e) {
+		const char* error = plainBuffer.Error() != NULL ? plainBuffer.Error()
+			: cipheredBuffer.Error();
+		if (error != NULL) {
+			std::cerr << "Can't decompress input file: " << error << std::endl;
+			return false;
+		}
+		mismatch.truncated = true;
+		mismatch.reason = plainStream.good() ? "ciphered file is shorter"
+			: "plain file is shorter";
+		return false;
+	} catch(ParseError e) {
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+}
+
+
+bool IntelHex::operator==(const IntelHex& other) const
+{
+	if (fData != other.fData)
+		return false;
+
+	// The checksums can hide swapped bytes, so compare the data too
+	for (size_t i = 0; i < fData.size(); i++) {
+		if (memcmp(fPayload.data() + fData[i].Offset(),
+				other.fPayload.data() + other.fData[i].Offset(),
+				fData[i].Size()) != 0)
+			return false;
+	}
+	return true;
+}
+
+
+/// Parse a single line of intel hex data from input stream.
+/// @l line number, used for error reporting
+/// @buffer where to store the decoded line, the payload starts at buffer + 4.
+/// Will throw exceptions on errors reading the file.
+HexRecord IntelHex::ParseLine(std::istream& input, int l, uint8_t buffer[512])
+	throw(std::ios_base::failure, ParseError)
+{
+	char line[1026];
+
+	// Read line from file
+	input.getline(line, sizeof(line));
+	std::streamsize length = input.gcount() - 1;
+		// - 1 because the \n is replaced with the NULL char.
+
+	return ParseLine(line, length < 0 ? 0 : length, l, buffer);
+}
+
+
+/// Parse a single line of intel hex data, without throwing.
+/// @line the line text, without the trailing '\n'. Need not be NULL terminated.
+/// @length length of the line.
+/// @buffer where to store the decoded line, the payload starts at buffer + 4.
+/// @column set to the location of the error, if any.
+/// @returns kParseOK, or the error.
+ParseStatus IntelHex::ScanLine(const char* line, size_t length,
+	uint8_t buffer[512], int& column)
+{
+	if (length < 10 || line[0] != ':') {
+		column = 0;
+		return kParseBadStart;
+	}
+
+	if (length > 1025) {
+		column = 1025;
+		return kParseTooLong;
+	}
+
+	// Convert line to bytes, ignoring the end of line char
+	size_t end = length;
+	if (line[end - 1] == '\r')
+		end--;
+
+	size_t digits = end - 1;
+	uint8_t sum = 0;
+	long error = hex_decode(line + 1, digits / 2, buffer, &sum);
+	if (error < 0 && (digits & 1) && kHexDigitValue[(uint8_t)line[end - 1]] > 15)
+		error = digits - 1;
+	if (error >= 0) {
+		column = error + 1;
+		return kParseNotHex;
+	}
+
+	int byte = digits / 2;
+
+	if (sum != 0) {
+		column = length - 2;
+		return kParseChecksum;
+	}
+
+	uint8_t count = buffer[0];
+
+	if (count + 5 != byte) {
+		column = 2;
+		return kParseLength;
+	}
+
+	// Extended address records are read as a 2 bytes base address
+	if ((buffer[3] == 2 || buffer[3] == 4) && count != 2) {
+		column = 2;
+		return kParseBadAddress;
+	}
+
+	return kParseOK;
+}
+
+
+/// Parse a single line of intel hex data.
+/// @l line number, used for error reporting
+/// @returns the record, with an offset of 0.
+/// Throws a ParseError on errors, see ScanLine for the other parameters.
+HexRecord IntelHex::ParseLine(const char* line, size_t length, int l,
+	uint8_t buffer[512]) throw(ParseError)
+{
+	int column;
+	ParseStatus status = ScanLine(line, length, buffer, column);
+	if (status != kParseOK) {
+		throw ParseError(l, column, ParseFailure(status, l, column).Reason(),
+			std::string(line, length).c_str());
+	}
+
+	return HexRecord(buffer, 0);
+}
+
+
+/// Parse lines of intel hex data, up to the end record.
+/// @base start of the whole data, the offsets of the failures are from there.
+/// @data first line to parse.
+/// @end end of the lines to parse.
+/// @all go on after a bad line, to report all of them.
+/// @parsed where to add the records, their payload and the failures.
+void IntelHex::ParseLines(const char* base, const char* data, const char* end,
+	bool all, ParsedLines& parsed)
+{
+	parsed.lines = 0;
+	parsed.ended = parsed.failed = parsed.stopped = false;
+
+	uint8_t buffer[512];
+	while (data < end) {
+		const char* eol = (const char*)memchr(data, '\n', end - data);
+		if (eol == NULL)
+			eol = end;
+		parsed.lines++;
+
+		int column;
+		ParseStatus status = ScanLine(data, eol - data, buffer, column);
+		if (status != kParseOK) {
+			parsed.failures.push_back(ParseFailure(status, parsed.lines, column,
+				data - base, eol - data));
+			parsed.failed = true;
+			if (!all) {
+				parsed.stopped = true;
+				return;
+			}
+		} else {
+			if (parsed.payload.size() > UINT32_MAX - 255) {
+				parsed.failures.push_back(ParseFailure(kParseTooLarge,
+					parsed.lines, 0));
+				parsed.failed = parsed.stopped = true;
+				return;
+			}
+			parsed.records.push_back(HexRecord(buffer, parsed.payload.size()));
+			parsed.payload.insert(parsed.payload.end(), buffer + 4,
+				buffer + 4 + buffer[0]);
+			if (buffer[3] == 1) {
+				parsed.ended = true;
+				return;
+			}
+		}
+
+		data = eol + 1;
+	}
+}
+
+
+/// Parse intel hex data from a memory buffer.
+/// Lines are parsed in place, without copying them.
+/// @failures the errors are added there.
+/// @all go on after a bad line, to report all of them. The data is not
+/// usable after an error either way.
+/// @returns true on success, false on error.
+bool IntelHex::Parse(const char* data, size_t length,
+	std::vector<ParseFailure>& failures, bool all)
+{
+	fData.clear();
+	fPayload.clear();
+
+	if (fThreads > 1 && length >= 2 * ParseChunkSize())
+		return ParseParallel(data, length, failures, all);
+
+	// A line has at least 11 chars and a line feed, and 2 chars per data byte
+	ParsedLines parsed;
+	parsed.records.swap(fData);
+	parsed.payload.swap(fPayload);
+	parsed.records.reserve(length / 12 + 1);
+	parsed.payload.reserve(length / 2);
+	HEXSTATS_ADD(fStats, allocations, 2);
+
+	ParseLines(data, data, data + length, all, parsed);
+	fData.swap(parsed.records);
+	fPayload.swap(parsed.payload);
+	failures.insert(failures.end(), parsed.failures.begin(),
+		parsed.failures.end());
+	return FinishParse(parsed.ended, parsed.failed, parsed.stopped,
+		parsed.lines, failures);
+}
+
+
+/// Parse intel hex data from a stream, a block of lines at a time, so only
+/// the image and one block are in memory. This is used for compressed files.
+/// @print write the first error to the standard error, while its line is
+/// still in the block. The failures don't keep the text of the lines.
+/// See Parse for the other parameters.
+bool IntelHex::ParseStream(DecompressStreamBuffer& input,
+	std::vector<ParseFailure>& failures, bool all, bool print)
+{
+	fData.clear();
+	fPayload.clear();
+
+	ParsedLines parsed;
+	parsed.records.swap(fData);
+	parsed.payload.swap(fPayload);
+	std::vector<char> block(1 << 18);
+	HEXSTATS_ADD(fStats, allocations, 1);
+
+	size_t first = failures.size();
+	size_t used = 0;
+	int lines = 0;
+	bool ended = false;
+	bool failed = false;
+	bool stopped = false;
+	while (!ended && !stopped) {
+		used += input.sgetn(block.data() + used, block.size() - used);
+		if (used == 0 || input.Error() != NULL)
+			break;
+
+		// Only whole lines are parsed, the rest is kept for the next block.
+		// A block without any line feed is parsed as is, it is too long.
+		const char* end = block.data() + used;
+		const char* stop = end;
+		if (used == block.size()) {
+			const char* eol = end;
+			while (eol > block.data() && eol[-1] != '\n')
+				eol--;
+			if (eol > block.data())
+				stop = eol;
+		}
+
+		ParseLines(block.data(), block.data(), stop, all, parsed);
+		for (ParseFailure failure: parsed.failures) {
+			failure.line += lines;
+			if (print && failures.size() == first)
+				std::cerr << failure.Message(block.data()) << std::endl;
+			failure.offset = failure.length = 0;
+			failures.push_back(failure);
+		}
+		parsed.failures.clear();
+		lines += parsed.lines;
+		ended = parsed.ended;
+		failed = failed || parsed.failed;
+		stopped = parsed.stopped;
+
+		used = end - stop;
+		memmove(block.data(), stop, used);
+	}
+	fData.swap(parsed.records);
+	fPayload.swap(parsed.payload);
+
+	if (input.Error() != NULL) {
+		std::cerr << "Can't decompress input file: " << input.Error()
+			<< std::endl;
+		return false;
+	}
+	if (!FinishParse(ended, failed, stopped, lines, failures)) {
+		if (print && failures.size() > first && !failed)
+			std::cerr << failures[first].Message(NULL) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+/// Parse intel hex data on several threads.
+/// The data is split in chunks at line boundaries, which are parsed in
+/// parallel, each in its own records and payload. They are then appended in
+/// order, up to the end record, and the line numbers of the failures are
+/// made relative to the whole data. The extended addresses are resolved
+/// afterwards by BuildIndex, as for sequential parsing.
+bool IntelHex::ParseParallel(const char* data, size_t length,
+	std::vector<ParseFailure>& failures, bool all)
+{
+	const char* end = data + length;
+	std::vector<const char*> starts(1, data);
+	while (starts.back() < end) {
+		const char* next = starts.back() + ParseChunkSize();
+		if (next >= end)
+			next = end;
+		else {
+			next = (const char*)memchr(next, '\n', end - next);
+			next = next == NULL ? end : next + 1;
+		}
+		starts.push_back(next);
+	}
+
+	std::vector<ParsedLines> chunks(starts.size() - 1);
+	run_parallel(fThreads, chunks.size(), [&](size_t chunk, size_t) {
+		size_t size = starts[chunk + 1] - starts[chunk];
+		chunks[chunk].records.reserve(size / 12 + 1);
+		chunks[chunk].payload.reserve(size / 2);
+		ParseLines(data, starts[chunk], starts[chunk + 1], all, chunks[chunk]);
+	});
+	HEXSTATS_ADD(fStats, allocations, 2 * chunks.size() + 2);
+
+	size_t records = 0;
+	size_t payload = 0;
+	for (const ParsedLines& chunk: chunks) {
+		records += chunk.records.size();
+		payload += chunk.payload.size();
+	}
+	fData.reserve(records);
+	fPayload.reserve(std::min<size_t>(payload, UINT32_MAX));
+
+	int lines = 0;
+	bool ended = false;
+	bool failed = false;
+	bool stopped = false;
+	for (ParsedLines& chunk: chunks) {
+		for (ParseFailure failure: chunk.failures) {
+			failure.line += lines;
+			failures.push_back(failure);
+		}
+		failed = failed || chunk.failed;
+		if (chunk.stopped) {
+			stopped = true;
+			break;
+		}
+
+		if (fPayload.size() + chunk.payload.size() > UINT32_MAX - 255) {
+			failures.push_back(ParseFailure(kParseTooLarge,
+				lines + chunk.lines, 0));
+			failed = stopped = true;
+			break;
+		}
+		uint32_t offset = fPayload.size();
+		for (HexRecord& record: chunk.records) {
+			record.SetOffset(record.Offset() + offset);
+			fData.push_back(record);
+		}
+		fPayload.insert(fPayload.end(), chunk.payload.begin(),
+			chunk.payload.end());
+
+		lines += chunk.lines;
+		if (chunk.ended) {
+			ended = true;
+			break;
+		}
+	}
+
+	return FinishParse(ended, failed, stopped, lines, failures);
+}
+
+
+/// Check the end of the parsed data, and index it.
+/// @lines the number of lines parsed, up to the end record if it was found.
+/// @returns true if the data is valid.
+bool IntelHex::FinishParse(bool ended, bool failed, bool stopped, int lines,
+	std::vector<ParseFailure>& failures)
+{
+	if (!ended) {
+		if (!stopped)
+			failures.push_back(ParseFailure(kParseNoEnd, lines + 1, 0));
+		return false;
+	}
+
+	HEXSTATS_ADD(fStats, lines, lines);
+	BuildIndex();
+	return !failed;
+}
+
+
+/// Cipher intel hex data from input stream to output stream, one record at a
+/// time.
+/// Will throw exceptions on errors reading or writing the files.
+void IntelHex::StreamCipher(std::istream& input, std::ostream& output,
+	const CipherContext& context, const HexFormat& format, HexStats& stats)
+	throw(std::ios_base::failure, ParseError)
+{
+	uint8_t state[256];
+	context.CopyState(state);
+
+	uint8_t buffer[512];
+	for(int l = 1; true; l++) {
+		HexRecord r = ParseLine(input, l, buffer);
+		HEXSTATS_ADD(stats, lines, 1);
+		if (r.type == 0) {
+			HEXSTATS_ADD(stats, dataRecords, 1);
+			HEXSTATS_ADD(stats, bytesCiphered, r.Size());
+		}
+		r.Cipher(state, buffer + 4);
+		r.Generate(output, buffer + 4, format);
+		HEXSTATS_ADD(stats, bytesWritten, r.GeneratedSize(format));
+		if (r.type == 1)
+			return;
+	}
+}
+
+
+/// Generate the records into a buffer of at least GeneratedSize() chars.
+/// @returns the number of chars written.
+size_t IntelHex::Generate(char* output)
+{
+	if (Parallel()) {
+		// Each chunk is generated at its place in the output
+		std::vector<size_t> offsets(1, 0);
+		for (size_t first = 0; first < fData.size(); first += fChunk) {
+			size_t last = std::min(first + fChunk, fData.size());
+			size_t length = 0;
+			for (size_t i = first; i < last; i++)
+				length += fData[i].GeneratedSize(fFormat);
+			offsets.push_back(offsets.back() + length);
+		}
+
+		RunChunks([&](size_t first, size_t last, HexStats& stats) {
+			char* out = output + offsets[first / fChunk];
+			for (size_t i = first; i < last; i++) {
+				const HexRecord& line = fData[i];
+				out += line.Generate(out, fPayload.data() + line.Offset(),
+					fFormat);
+			}
+			HEXSTATS_ADD(stats, bytesWritten, out - output
+				- offsets[first / fChunk]);
+		});
+
+		// The digests are sequential, they are computed from memory after
+		if (fDigests) {
+			HexDigester digester;
+			digester.AddText(output, offsets.back());
+			DigestPayload(0, fData.size(), digester);
+			digester.Finish(fDigest);
+		}
+		return offsets.back();
+	}
+
+	char* start = output;
+	if (!fDigests) {
+		for (const auto& line: fData) {
+			output += line.Generate(output, fPayload.data() + line.Offset(),
+				fFormat);
+		}
+		HEXSTATS_ADD(fStats, bytesWritten, output - start);
+		return output - start;
+	}
+
+	// Hash blocks of records as soon as they are generated, while they are
+	// in the cache
+	static const size_t kDigestBlock = 16384;
+	HexDigester digester;
+	char* block = output;
+	size_t first = 0;
+	for (size_t i = 0; i < fData.size(); i++) {
+		const HexRecord& line = fData[i];
+		output += line.Generate(output, fPayload.data() + line.Offset(),
+			fFormat);
+		if ((size_t)(output - block) >= kDigestBlock || i + 1 == fData.size()) {
+			digester.AddText(block, output - block);
+			DigestPayload(first, i + 1, digester);
+			block = output;
+			first = i + 1;
+		}
+	}
+	digester.Finish(fDigest);
+	HEXSTATS_ADD(fStats, bytesWritten, output - start);
+	return output - start;
+}
+
+
+/// Add the payload of the data records from first to last (excluded) to the
+/// digests. Records are usually next to each other in fPayload, so runs of
+/// them are added at once.
+void IntelHex::DigestPayload(size_t first, size_t last,
+	HexDigester& digester) const
+{
+	size_t start = 0;
+	size_t end = 0;
+	for (size_t i = first; i < last; i++) {
+		const HexRecord& line = fData[i];
+		if (line.type != 0 || line.Size() == 0)
+			continue;
+		if (line.Offset() != end) {
+			digester.AddPayload(fPayload.data() + start, end - start);
+			start = line.Offset();
+		}
+		end = line.Offset() + line.Size();
+	}
+	digester.AddPayload(fPayload.data() + start, end - start);
+}
+
+
+void IntelHex::Cipher(const uint8_t* key, int len)
+{
+	Cipher(CipherContext(key, len));
+}
+
+
+void IntelHex::Cipher(const CipherContext& context)
+{
+	HEXSTATS_PHASE(fStats, cipherTime, fStatsListener, "cipher");
+	uint8_t state[256];
+	context.CopyState(state);
+
+	if (!Parallel()) {
+		CipherRecords(state, 0, fData.size(), fStats);
+		return;
+	}
+
+	// Only the keystream is sequential. Run through it once without using it,
+	// saving the state at the start of each chunk, then cipher the chunks in
+	// parallel from there. The indices restart on each record, so the state
+	// is all there is to save.
+	size_t count = (fData.size() + fChunk - 1) / fChunk;
+	std::vector<uint8_t> checkpoints(count * 256);
+	for (size_t chunk = 0; chunk < count; chunk++) {
+		memcpy(&checkpoints[chunk * 256], state, 256);
+		size_t last = std::min((chunk + 1) * fChunk, fData.size());
+		for (size_t i = chunk * fChunk; i < last && chunk + 1 < count; i++) {
+			if (fData[i].type == 0)
+				keystream_advance(state, fData[i].Size());
+		}
+	}
+
+	RunChunks([&](size_t first, size_t last, HexStats& stats) {
+		uint8_t chunkState[256];
+		memcpy(chunkState, &checkpoints[first / fChunk * 256], 256);
+		CipherRecords(chunkState, first, last, stats);
+	});
+}
+
+
+/// Cipher only the data at the given absolute addresses.
+/// The ranges are merged first, so adjacent or overlapping ones act as one.
+/// Each part of a record inside a range consumes keystream as if it were a
+/// record of its own: it gets a separate call to the generator, in address
+/// order, and data outside the ranges consumes nothing. When the ranges
+/// cover the whole image, this is the same as the other Cipher functions.
+void IntelHex::Cipher(const CipherContext& context,
+	std::vector<AddressRange> ranges)
+{
+	HEXSTATS_PHASE(fStats, cipherTime, fStatsListener, "cipher");
+
+	std::sort(ranges.begin(), ranges.end(),
+		[](const AddressRange& a, const AddressRange& b) {
+			return a.start < b.start;
+		});
+	std::vector<AddressRange> merged;
+	for (const AddressRange& range: ranges) {
+		if (range.start >= range.end)
+			continue;
+		if (!merged.empty() && range.start <= merged.back().end)
+			merged.back().end = std::max(merged.back().end, range.end);
+		else
+			merged.push_back(range);
+	}
+
+	uint8_t state[256];
+	context.CopyState(state);
+	uint8_t stream[256];
+
+	uint32_t extended = 0;
+	for (auto& line: fData) {
+		uint8_t* payload = fPayload.data() + line.Offset();
+		if (line.IsExtendedAddress())
+			extended = line.ExtendedAddress(payload);
+		if (line.type != 0)
+			continue;
+
+		AddressRange record((uint64_t)extended + line.Address(), 0);
+		record.end = record.start + line.Size();
+
+		// First range ending after the start of the record
+		auto range = std::upper_bound(merged.begin(), merged.end(),
+			record.start, [](uint64_t address, const AddressRange& range) {
+				return address < range.end;
+			});
+
+		bool changed = false;
+		for (; range != merged.end() && range->start < record.end; range++) {
+			uint64_t start = std::max(range->start, record.start);
+			uint64_t end = std::min(range->end, record.end);
+			keystream_generate(state, stream, end - start);
+			xor_and_sum(payload + (start - record.start), stream, end - start);
+			HEXSTATS_ADD(fStats, bytesCiphered, end - start);
+			changed = true;
+		}
+
+		if (changed) {
+			line.UpdateChecksum(payload);
+			HEXSTATS_ADD(fStats, dataRecords, 1);
+		}
+	}
+}
+
+
+/// Cipher with a counter based engine.
+/// Only the extended address records are sequential: the base address at the
+/// start of each chunk is found first, then the chunks are ciphered in
+/// parallel.
+void IntelHex::Cipher(const CipherEngine& engine)
+{
+	HEXSTATS_PHASE(fStats, cipherTime, fStatsListener, "cipher");
+
+	std::vector<uint32_t> bases(1, 0);
+	if (Parallel()) {
+		uint32_t extended = 0;
+		for (size_t i = 0; i < fData.size(); i++) {
+			if (i % fChunk == 0 && i > 0)
+				bases.push_back(extended);
+			const HexRecord& line = fData[i];
+			if (line.IsExtendedAddress())
+				extended = line.ExtendedAddress(fPayload.data() + line.Offset());
+		}
+	}
+
+	auto work = [&](size_t first, size_t last, HexStats& stats) {
+		uint32_t extended = bases[first / fChunk];
+		for (size_t i = first; i < last; i++) {
+			HexRecord& line = fData[i];
+			uint8_t* payload = fPayload.data() + line.Offset();
+			if (line.IsExtendedAddress())
+				extended = line.ExtendedAddress(payload);
+			if (line.type != 0)
+				continue;
+
+			engine.Apply((uint64_t)extended + line.Address(), payload,
+				line.Size());
+			line.UpdateChecksum(payload);
+			HEXSTATS_ADD(stats, dataRecords, 1);
+			HEXSTATS_ADD(stats, bytesCiphered, line.Size());
+		}
+	};
+
+	if (Parallel())
+		RunChunks(work);
+	else
+		work(0, fData.size(), fStats);
+}
+
+
+/// Cipher the data, reusing the work done for a previous version of it.
+/// The keystream of a data record only depends on the size of the data
+/// records before it. As long as the sizes are the same as in the previous
+/// version, it is the XOR of the previous plain and ciphered data, and the
+/// ciphered data is reused as is where the plain data didn't change. From the
+/// first record of a different size, the state is advanced past the data
+/// before it, and the rest is ciphered as usual.
+/// The previous version must have been ciphered with the same context and
+/// Cipher(context). If the first data record doesn't give the same keystream,
+/// or the two previous files don't match, nothing is reused.
+/// @plain the previous version, not ciphered.
+/// @ciphered the previous version, ciphered.
+/// @returns the number of data records which reused the previous keystream.
+size_t IntelHex::Cipher(const CipherContext& context, const IntelHex& plain,
+	const IntelHex& ciphered)
+{
+	HEXSTATS_PHASE(fStats, cipherTime, fStatsListener, "cipher");
+
+	std::vector<const HexRecord*> previous;
+	bool usable = plain.fData.size() == ciphered.fData.size();
+	for (size_t i = 0; usable && i < plain.fData.size(); i++) {
+		const HexRecord& line = plain.fData[i];
+		usable = line.type == ciphered.fData[i].type
+			&& line.Size() == ciphered.fData[i].Size();
+		if (line.type == 0)
+			previous.push_back(&line);
+	}
+
+	uint8_t state[256];
+	context.CopyState(state);
+
+	// Check the key with the first data record
+	if (usable && !previous.empty()) {
+		uint8_t copy[256];
+		uint8_t stream[256];
+		memcpy(copy, state, 256);
+		const HexRecord& line = *previous[0];
+		keystream_generate(copy, stream, line.Size());
+		const uint8_t* p = plain.fPayload.data() + line.Offset();
+		const uint8_t* c = ciphered.fPayload.data() + line.Offset();
+		for (int b = 0; usable && b < line.Size(); b++)
+			usable = (p[b] ^ c[b]) == stream[b];
+	}
+
+	size_t reused = 0;
+	size_t i = 0;
+	for (; usable && i < fData.size(); i++) {
+		HexRecord& line = fData[i];
+		if (line.type != 0)
+			continue;
+		if (reused == previous.size() || previous[reused]->Size() != line.Size())
+			break;
+
+		const uint8_t* p = plain.fPayload.data() + previous[reused]->Offset();
+		const uint8_t* c = ciphered.fPayload.data() + previous[reused]->Offset();
+		uint8_t stream[256];
+		for (int b = 0; b < line.Size(); b++)
+			stream[b] = p[b] ^ c[b];
+		line.SetPayloadSum(xor_and_sum(fPayload.data() + line.Offset(), stream,
+			line.Size()));
+		reused++;
+		HEXSTATS_ADD(fStats, dataRecords, 1);
+		HEXSTATS_ADD(fStats, bytesCiphered, line.Size());
+	}
+
+	while (i < fData.size() && fData[i].type != 0)
+		i++;
+	if (i == fData.size())
+		return reused;
+
+	// Catch up with the keystream for the rest
+	for (size_t k = 0; k < reused; k++)
+		keystream_advance(state, previous[k]->Size());
+	CipherRecords(state, i, fData.size(), fStats);
+	return reused;
+}
+
+
+/// Cipher the data with many keys at once, without parsing it again.
+/// The records are handled in blocks: a thread ciphers a block for a few
+/// keys in turn, so the plain data is read from the cache for all of them.
+/// Groups of keys are spread on the threads given to SetThreads.
+/// @contexts the keys to use.
+/// @copies resized to one copy per context, in the same order. Their format
+/// is the same as this one.
+void IntelHex::CipherCopies(const std::vector<const CipherContext*>& contexts,
+	std::vector<IntelHex>& copies)
+{
+	HEXSTATS_PHASE(fStats, cipherTime, fStatsListener, "cipher");
+
+	static const size_t kKeysPerGroup = 4;
+	static const size_t kBlockSize = 16384;
+
+	copies.resize(contexts.size());
+	size_t groups = (contexts.size() + kKeysPerGroup - 1) / kKeysPerGroup;
+	run_parallel(fThreads, groups, [&](size_t group, size_t) {
+		size_t firstKey = group * kKeysPerGroup;
+		size_t lastKey = std::min(firstKey + kKeysPerGroup, contexts.size());
+
+		uint8_t states[kKeysPerGroup][256];
+		for (size_t k = firstKey; k < lastKey; k++) {
+			contexts[k]->CopyState(states[k - firstKey]);
+			IntelHex& copy = copies[k];
+			copy.fData = fData;
+			copy.fPayload.resize(fPayload.size());
+			copy.fIndex = fIndex;
+			copy.fFormat = fFormat;
+			copy.fDigests = fDigests;
+			HEXSTATS_ADD(copy.fStats, allocations, 2);
+		}
+
+		uint8_t stream[256];
+		size_t first = 0;
+		while (first < fData.size()) {
+			// A block of records, with at most kBlockSize bytes of payload
+			size_t last = first;
+			for (size_t used = 0; last < fData.size()
+					&& used + fData[last].Size() <= kBlockSize; last++)
+				used += fData[last].Size();
+
+			for (size_t k = firstKey; k < lastKey; k++) {
+				IntelHex& copy = copies[k];
+				for (size_t i = first; i < last; i++) {
+					const HexRecord& line = fData[i];
+					uint8_t* payload = copy.fPayload.data() + line.Offset();
+					memcpy(payload, fPayload.data() + line.Offset(), line.Size());
+					if (line.type != 0)
+						continue;
+					keystream_generate(states[k - firstKey], stream, line.Size());
+					copy.fData[i].SetPayloadSum(xor_and_sum(payload, stream,
+						line.Size()));
+					HEXSTATS_ADD(copy.fStats, dataRecords, 1);
+					HEXSTATS_ADD(copy.fStats, bytesCiphered, line.Size());
+				}
+			}
+			first = last;
+		}
+	});
+}
+
+
+/// Merge contiguous data records, and split them again in records of the
+/// given length (the last one in each run may be shorter).
+/// Records are contiguous when they follow each other in the file, with no
+/// other record type in between, and the address of the second one is right
+/// after the end of the first one. So an extended address record always
+/// starts a new run, and records are never merged across a 64K boundary.
+///
+/// The keystream restarts its indices for each record, so the ciphered data
+/// depends on the record boundaries. Repack before ciphering: the output then
+/// deciphers with the repacked layout, the one found in the file. Repacking a
+/// ciphered file makes it impossible to decipher.
+void IntelHex::Repack(uint8_t length)
+{
+	if (length == 0)
+		return;
+
+	std::vector<HexRecord> records;
+	records.reserve(fData.size());
+
+	size_t i = 0;
+	while (i < fData.size()) {
+		if (fData[i].type != 0) {
+			records.push_back(fData[i++]);
+			continue;
+		}
+
+		// Find the run of contiguous records. Their payloads follow each other
+		// in fPayload, so the new records can point there directly.
+		uint32_t start = fData[i].Address();
+		uint32_t end = start + fData[i].Size();
+		uint32_t offset = fData[i].Offset();
+		for (i++; i < fData.size(); i++) {
+			const HexRecord& next = fData[i];
+			if (next.type != 0 || next.Address() != end)
+				break;
+			end += next.Size();
+		}
+
+		for (uint32_t address = start; address < end; address += length) {
+			uint8_t size = end - address < length ? end - address : length;
+			records.push_back(HexRecord(0, address, size,
+				fPayload.data() + offset, offset));
+			offset += size;
+		}
+	}
+
+	HEXSTATS_ADD(fStats, allocations, 1);
+	fData.swap(records);
+	BuildIndex();
+}
+
+
+/// Resolve the absolute address of each data record from the extended address
+/// records before it, and index them.
+void IntelHex::BuildIndex()
+{
+	fIndex.Clear();
+
+	uint32_t extended = 0;
+	for (size_t i = 0; i < fData.size(); i++) {
+		const HexRecord& line = fData[i];
+		if (line.IsExtendedAddress())
+			extended = line.ExtendedAddress(fPayload.data() + line.Offset());
+		else if (line.type == 0)
+			fIndex.Add((uint64_t)extended + line.Address(), line.Size(), i);
+	}
+
+	fIndex.Finish();
+}
+
+
+const uint8_t* IntelHex::DataAt(uint32_t address) const
+{
+	const AddressIndex::Entry* entry = fIndex.Find(address);
+	if (entry == NULL)
+		return NULL;
+
+	return fPayload.data() + fData[entry->record].Offset()
+		+ (address - entry->start);
+}
+
+
+/// Hash the data in each aligned block of addresses which has some.
+/// A block is assembled with a map of the bytes present, so the hash only
+/// depends on the data at each address, not on how it is split in records.
+/// Where records overlap, the last one in the file is used, as in DataAt.
+/// @hashes the blocks with data, by address.
+void IntelHex::HashBlocks(uint32_t block, std::vector<BlockHash>& hashes) const
+{
+	hashes.clear();
+	const std::vector<AddressRange>& overlaps = fIndex.Overlaps();
+	size_t overlap = 0;
+
+	// Both are a whole number of words, block being a multiple of 8
+	std::vector<uint8_t> data(block * 2);
+	uint8_t* present = data.data() + block;
+	uint64_t current = UINT64_MAX;
+	auto flush = [&]() {
+		if (current == UINT64_MAX)
+			return;
+		uint64_t hash = current;
+		for (size_t i = 0; i < data.size(); i += 8) {
+			uint64_t word;
+			memcpy(&word, data.data() + i, 8);
+			hash = hash_mix(hash, word);
+		}
+		BlockHash entry = { current, hash };
+		hashes.push_back(entry);
+		memset(data.data(), 0, data.size());
+	};
+
+	uint64_t done = 0;
+		// Addresses below are already in a block
+	for (const AddressIndex::Entry& entry: fIndex.Entries()) {
+		const uint8_t* payload = fPayload.data() + fData[entry.record].Offset();
+		uint64_t address = std::max(entry.start, done);
+		while (address < entry.End()) {
+			if (address / block != current) {
+				flush();
+				current = address / block;
+			}
+			uint64_t end = std::min(entry.End(), (current + 1) * block);
+
+			while (overlap < overlaps.size() && overlaps[overlap].end <= address)
+				overlap++;
+			if (overlap < overlaps.size() && overlaps[overlap].Contains(address)) {
+				end = std::min(end, overlaps[overlap].end);
+				for (uint64_t a = address; a < end; a++)
+					data[a % block] = *DataAt(a);
+			} else {
+				if (overlap < overlaps.size())
+					end = std::min(end, overlaps[overlap].start);
+				memcpy(&data[address % block], payload + (address - entry.start),
+					end - address);
+			}
+			memset(present + address % block, 1, end - address);
+			address = end;
+		}
+		done = std::max(done, entry.End());
+	}
+	flush();
+}
+
+
+/// Compare the data with an older image. Blocks are hashed in both images,
+/// which is linear in the size of the data, and only the blocks with a
+/// different hash are compared byte by byte to find the exact addresses.
+std::vector<AddressRange> IntelHex::Diff(const IntelHex& old,
+	uint32_t block) const
+{
+	if (block > kMaxDiffBlock)
+		block = kMaxDiffBlock;
+	block = std::max<uint32_t>(block, 8) & ~7u;
+
+	std::vector<BlockHash> mine;
+	std::vector<BlockHash> theirs;
+	HashBlocks(block, mine);
+	old.HashBlocks(block, theirs);
+
+	std::vector<AddressRange> changed;
+	size_t other = 0;
+	for (const BlockHash& hash: mine) {
+		while (other < theirs.size() && theirs[other].block < hash.block)
+			other++;
+		if (other < theirs.size() && theirs[other].block == hash.block
+				&& theirs[other].hash == hash.hash)
+			continue;
+
+		uint64_t start = hash.block * block;
+		for (uint64_t address = start; address < start + block; address++) {
+			const uint8_t* data = DataAt(address);
+			if (data == NULL)
+				continue;
+			const uint8_t* previous = old.DataAt(address);
+			if (previous != NULL && *previous == *data)
+				continue;
+			if (!changed.empty() && changed.back().end == address)
+				changed.back().end++;
+			else
+				changed.push_back(AddressRange(address, address + 1));
+		}
+	}
+	return changed;
+}
+
+
+/// Build a patch with the records which changed between two images.
+/// Records are copied whole and unchanged, so a patch of ciphered images has
+/// the ciphered records as they are in the updated image. Other records than
+/// data and extended addresses, such as the start address, are kept.
+void IntelHex::Patch(const IntelHex& old, const IntelHex& updated,
+	uint32_t block)
+{
+	std::vector<AddressRange> changed = updated.Diff(old, block);
+
+	fData.clear();
+	fPayload.clear();
+	auto copy = [&](const HexRecord& record) {
+		const uint8_t* payload = updated.fPayload.data() + record.Offset();
+		HexRecord line = record;
+		line.SetOffset(fPayload.size());
+		fData.push_back(line);
+		fPayload.insert(fPayload.end(), payload, payload + record.Size());
+	};
+
+	uint32_t extended = 0;
+	uint32_t written = 0;
+		// Extended address in the patch
+	const HexRecord* base = NULL;
+	for (const HexRecord& record: updated.fData) {
+		const uint8_t* payload = updated.fPayload.data() + record.Offset();
+		if (record.IsExtendedAddress()) {
+			extended = record.ExtendedAddress(payload);
+			base = &record;
+			continue;
+		}
+		if (record.type == 1)
+			break;
+		if (record.type != 0) {
+			copy(record);
+			continue;
+		}
+
+		AddressRange range((uint64_t)extended + record.Address(),
+			(uint64_t)extended + record.Address() + record.Size());
+		auto found = std::upper_bound(changed.begin(), changed.end(),
+			range.start, [](uint64_t address, const AddressRange& area) {
+				return address < area.end;
+			});
+		if (found == changed.end() || !found->Intersects(range))
+			continue;
+
+		if (extended != written) {
+			copy(*base);
+			written = extended;
+		}
+		copy(record);
+	}
+
+	fData.push_back(HexRecord(1, 0, 0, NULL, fPayload.size()));
+	HEXSTATS_ADD(fStats, allocations, 2);
+	BuildIndex();
+}
+
+
+/// Cipher records from first to last (excluded) with the running ARC4 state.
+/// The keystream is generated for a batch of records at once, then XORed with
+/// their payload while computing the new checksums. Each record still gets
+/// its own call to the generator, so the output is the same as HexRecord's
+/// Cipher.
+void IntelHex::CipherRecords(uint8_t state[256], size_t first, size_t last,
+	HexStats& stats)
+{
+	uint8_t stream[16384];
+
+	while (first < last) {
+		size_t end = first;
+		size_t used = 0;
+		for (; end < last; end++) {
+			const HexRecord& line = fData[end];
+			if (line.type != 0)
+				continue;
+			if (used + line.Size() > sizeof(stream))
+				break;
+			keystream_generate(state, stream + used, line.Size());
+			used += line.Size();
+			HEXSTATS_ADD(stats, dataRecords, 1);
+		}
+		HEXSTATS_ADD(stats, bytesCiphered, used);
+
+		used = 0;
+		for (; first < end; first++) {
+			HexRecord& line = fData[first];
+			if (line.type != 0)
+				continue;
+			line.SetPayloadSum(xor_and_sum(fPayload.data() + line.Offset(),
+				stream + used, line.Size()));
+			used += line.Size();
+		}
+	}
+}
+
+
+/// Run work on each chunk of fChunk records, on up to fThreads threads.
+/// Their statistics are added to fStats at the end.
+void IntelHex::RunChunks(
+	const std::function<void(size_t, size_t, HexStats&)>& work)
+{
+	size_t count = (fData.size() + fChunk - 1) / fChunk;
+	std::vector<HexStats> stats(std::min<size_t>(fThreads, count));
+	run_parallel(fThreads, count, [&](size_t chunk, size_t thread) {
+		work(chunk * fChunk, std::min((chunk + 1) * fChunk, fData.size()),
+			stats[thread]);
+	});
+
+	for (const HexStats& local: stats)
+		fStats += local;
+}
+
+#endif
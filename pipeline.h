@@ -0,0 +1,285 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/// Stream buffers doing their I/O on a thread of their own, so reading,
+/// parsing and writing a stream overlap instead of waiting for each other.
+/// The data goes between the threads in large blocks, through a ring of a few
+/// buffers allocated once. When the ring is full, the fastest side waits, so
+/// the total time is about that of the slowest stage.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+
+/// A ring of blocks passed from a producer thread to a consumer thread, in
+/// order. Each side waits when there is no block for it.
+class BlockRing {
+	public:
+		struct Block {
+			std::vector<char> data;
+			size_t used;
+		};
+
+		BlockRing(size_t count, size_t size);
+
+		Block* Fill();
+			// The next free block for the producer, NULL once closed.
+		void Filled();
+			// The block from Fill is ready for the consumer.
+		Block* Drain();
+			// The next ready block for the consumer, NULL once closed and
+			// all blocks are drained.
+		void Drained();
+			// The block from Drain can be filled again.
+		void Close();
+			// By the producer at the end of the data, or by either side to
+			// stop the other.
+
+	private:
+		std::vector<Block> fBlocks;
+		size_t fFirst;
+			// First ready block
+		size_t fReady;
+		bool fClosed;
+		std::mutex fLock;
+		std::condition_variable fChanged;
+};
+
+
+BlockRing::BlockRing(size_t count, size_t size)
+	: fBlocks(count)
+	, fFirst(0)
+	, fReady(0)
+	, fClosed(false)
+{
+	for (Block& block: fBlocks) {
+		block.data.resize(size);
+		block.used = 0;
+	}
+}
+
+
+BlockRing::Block* BlockRing::Fill()
+{
+	std::unique_lock<std::mutex> lock(fLock);
+	fChanged.wait(lock, [this]() {
+		return fClosed || fReady < fBlocks.size();
+	});
+	if (fClosed)
+		return NULL;
+	return &fBlocks[(fFirst + fReady) % fBlocks.size()];
+}
+
+
+void BlockRing::Filled()
+{
+	std::lock_guard<std::mutex> lock(fLock);
+	fReady++;
+	fChanged.notify_all();
+}
+
+
+BlockRing::Block* BlockRing::Drain()
+{
+	std::unique_lock<std::mutex> lock(fLock);
+	fChanged.wait(lock, [this]() { return fClosed || fReady > 0; });
+	if (fReady == 0)
+		return NULL;
+	return &fBlocks[fFirst];
+}
+
+
+void BlockRing::Drained()
+{
+	std::lock_guard<std::mutex> lock(fLock);
+	fFirst = (fFirst + 1) % fBlocks.size();
+	fReady--;
+	fChanged.notify_all();
+}
+
+
+void BlockRing::Close()
+{
+	std::lock_guard<std::mutex> lock(fLock);
+	fClosed = true;
+	fChanged.notify_all();
+}
+
+
+/// Read a source stream buffer ahead, on another thread.
+/// The source is only used by that thread until this is destroyed. Reading
+/// from it must not block forever, as the destructor waits for the current
+/// read to end.
+class ReadAheadStreamBuffer: public std::streambuf {
+	public:
+		ReadAheadStreamBuffer(std::streambuf* source, size_t size = 1 << 18,
+			size_t count = 4);
+		~ReadAheadStreamBuffer();
+
+	protected:
+		int_type underflow();
+
+	private:
+		void Read();
+
+		std::streambuf* fSource;
+		BlockRing fRing;
+		BlockRing::Block* fCurrent;
+		std::thread fThread;
+};
+
+
+ReadAheadStreamBuffer::ReadAheadStreamBuffer(std::streambuf* source,
+	size_t size, size_t count)
+	: fSource(source)
+	, fRing(std::max<size_t>(count, 2), size)
+	, fCurrent(NULL)
+{
+	setg(NULL, NULL, NULL);
+	fThread = std::thread(&ReadAheadStreamBuffer::Read, this);
+}
+
+
+ReadAheadStreamBuffer::~ReadAheadStreamBuffer()
+{
+	fRing.Close();
+	fThread.join();
+}
+
+
+void ReadAheadStreamBuffer::Read()
+{
+	while (BlockRing::Block* block = fRing.Fill()) {
+		block->used = fSource->sgetn(block->data.data(), block->data.size());
+		if (block->used == 0)
+			break;
+		fRing.Filled();
+	}
+	fRing.Close();
+}
+
+
+ReadAheadStreamBuffer::int_type ReadAheadStreamBuffer::underflow()
+{
+	if (fCurrent != NULL)
+		fRing.Drained();
+	fCurrent = fRing.Drain();
+	if (fCurrent == NULL) {
+		setg(NULL, NULL, NULL);
+		return traits_type::eof();
+	}
+
+	char* data = fCurrent->data.data();
+	setg(data, data, data + fCurrent->used);
+	return traits_type::to_int_type(*gptr());
+}
+
+
+/// Write to a sink stream buffer behind, on another thread.
+/// Finish waits for all the data to be written. The sink is only used by that
+/// thread until then.
+class WriteBehindStreamBuffer: public std::streambuf {
+	public:
+		WriteBehindStreamBuffer(std::streambuf* sink, size_t size = 1 << 18,
+			size_t count = 4);
+		~WriteBehindStreamBuffer() { Finish(); }
+
+		bool Finish();
+			// Write what is left and stop the thread.
+			// @returns false if the sink didn't take all the data.
+
+	protected:
+		int_type overflow(int_type c);
+		int sync();
+			// Hand the buffered data to the writer thread.
+
+	private:
+		void Write();
+
+		std::streambuf* fSink;
+		BlockRing fRing;
+		BlockRing::Block* fCurrent;
+		std::atomic<bool> fFailed;
+		bool fFinished;
+		std::thread fThread;
+};
+
+
+WriteBehindStreamBuffer::WriteBehindStreamBuffer(std::streambuf* sink,
+	size_t size, size_t count)
+	: fSink(sink)
+	, fRing(std::max<size_t>(count, 2), size)
+	, fFailed(false)
+	, fFinished(false)
+{
+	fCurrent = fRing.Fill();
+	setp(fCurrent->data.data(), fCurrent->data.data() + fCurrent->data.size());
+	fThread = std::thread(&WriteBehindStreamBuffer::Write, this);
+}
+
+
+bool WriteBehindStreamBuffer::Finish()
+{
+	if (fFinished)
+		return !fFailed;
+
+	sync();
+	fFinished = true;
+	fRing.Close();
+	fThread.join();
+	setp(NULL, NULL);
+	if (!fFailed && fSink->pubsync() != 0)
+		fFailed = true;
+	return !fFailed;
+}
+
+
+void WriteBehindStreamBuffer::Write()
+{
+	while (BlockRing::Block* block = fRing.Drain()) {
+		// After a failure, the data is dropped so the producer doesn't wait
+		if (!fFailed && fSink->sputn(block->data.data(), block->used)
+				!= (std::streamsize)block->used)
+			fFailed = true;
+		fRing.Drained();
+	}
+}
+
+
+WriteBehindStreamBuffer::int_type WriteBehindStreamBuffer::overflow(int_type c)
+{
+	if (sync() != 0)
+		return traits_type::eof();
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+
+int WriteBehindStreamBuffer::sync()
+{
+	if (fFinished || fFailed)
+		return -1;
+	if (pptr() == pbase())
+		return 0;
+
+	fCurrent->used = pptr() - pbase();
+	fRing.Filled();
+	fCurrent = fRing.Fill();
+	char* data = fCurrent->data.data();
+	setp(data, data + fCurrent->data.size());
+	return 0;
+}
+
+#endif
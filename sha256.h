@@ -0,0 +1,270 @@
+/* HexCrypt - Encrypt and decrypt data in intel hex files.
+ * Copyright 2014, Adrien Destugues <pulkomandy@pulkomandy.tk>
+ * This program is distributed under the terms of the MIT licence.
+ */
+#ifndef SHA256_H
+#define SHA256_H
+
+/// SHA-256 (FIPS 180-4), computed incrementally. The compression function has
+/// a portable version and one using the SHA extensions of x86, selected at
+/// runtime.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#define SHA256_X86 1
+#include <immintrin.h>
+#endif
+
+
+/// Process 64-byte blocks.
+typedef void (*sha256_blocks_func)(uint32_t state[8], const uint8_t* data,
+	size_t count);
+
+
+static const uint32_t kSha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+static inline uint32_t sha256_rotate(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+
+static void sha256_blocks_scalar(uint32_t state[8], const uint8_t* data,
+	size_t count)
+{
+	for (; count > 0; count--, data += 64) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = ((uint32_t)data[4 * i] << 24) | (data[4 * i + 1] << 16)
+				| (data[4 * i + 2] << 8) | data[4 * i + 3];
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = sha256_rotate(w[i - 15], 7)
+				^ sha256_rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = sha256_rotate(w[i - 2], 17)
+				^ sha256_rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t s1 = sha256_rotate(e, 6) ^ sha256_rotate(e, 11)
+				^ sha256_rotate(e, 25);
+			uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+			uint32_t s0 = sha256_rotate(a, 2) ^ sha256_rotate(a, 13)
+				^ sha256_rotate(a, 22);
+			uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+
+#ifdef SHA256_X86
+/// The SHA instructions work on the state as ABEF and CDGH, and on four
+/// message words at a time, each group computed from the four before it.
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t* data,
+	size_t count)
+{
+	const __m128i kSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+		0x0405060700010203ULL);
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state),
+		0xB1);
+	__m128i state1 = _mm_shuffle_epi32(
+		_mm_loadu_si128((const __m128i*)(state + 4)), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; count > 0; count--, data += 64) {
+		__m128i saved0 = state0;
+		__m128i saved1 = state1;
+
+		__m128i w[4];
+		for (int g = 0; g < 16; g++) {
+			__m128i& words = w[g % 4];
+			if (g < 4) {
+				words = _mm_shuffle_epi8(
+					_mm_loadu_si128((const __m128i*)(data + 16 * g)), kSwap);
+			} else {
+				// w[(g - 4) % 4] is the same slot as words
+				__m128i next = _mm_sha256msg1_epu32(words, w[(g - 3) % 4]);
+				next = _mm_add_epi32(next,
+					_mm_alignr_epi8(w[(g - 1) % 4], w[(g - 2) % 4], 4));
+				words = _mm_sha256msg2_epu32(next, w[(g - 1) % 4]);
+			}
+
+			__m128i message = _mm_add_epi32(words,
+				_mm_loadu_si128((const __m128i*)(kSha256K + 4 * g)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			message = _mm_shuffle_epi32(message, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+		}
+
+		state0 = _mm_add_epi32(state0, saved0);
+		state1 = _mm_add_epi32(state1, saved1);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i*)state, state0);
+	_mm_storeu_si128((__m128i*)(state + 4), state1);
+}
+#endif
+
+
+/// An implementation of the compression function for a given instruction set.
+struct sha256_kernel {
+	const char* name;
+	sha256_blocks_func blocks;
+	bool available;
+};
+
+
+/// All the implementations built in, best first, and whether the CPU can run
+/// them.
+static const sha256_kernel* sha256_kernels(size_t* count)
+{
+	static const sha256_kernel kernels[] = {
+#ifdef SHA256_X86
+		{ "shani", sha256_blocks_shani, __builtin_cpu_supports("sse4.1")
+			&& __builtin_cpu_supports("sha") },
+#endif
+		{ "scalar", sha256_blocks_scalar, true },
+	};
+
+	*count = sizeof(kernels) / sizeof(kernels[0]);
+	return kernels;
+}
+
+
+static const sha256_kernel& sha256_select_kernel()
+{
+	size_t count;
+	const sha256_kernel* kernels = sha256_kernels(&count);
+	for (size_t i = 0; i < count; i++) {
+		if (kernels[i].available)
+			return kernels[i];
+	}
+	return kernels[count - 1];
+}
+
+
+/// The best implementation for the running CPU.
+static inline const sha256_kernel& sha256_best_kernel()
+{
+	static const sha256_kernel& best = sha256_select_kernel();
+	return best;
+}
+
+
+/// A digest being computed. Data is hashed directly from the input when it
+/// spans whole blocks, only the partial ones are buffered.
+struct sha256_context {
+	uint32_t state[8];
+	uint8_t buffer[64];
+	size_t used;
+		// Bytes in the buffer
+	uint64_t length;
+		// Total bytes hashed
+	sha256_blocks_func blocks;
+};
+
+
+static inline void sha256_init(sha256_context* context,
+	sha256_blocks_func blocks = sha256_best_kernel().blocks)
+{
+	static const uint32_t kInitial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(context->state, kInitial, sizeof(kInitial));
+	context->used = 0;
+	context->length = 0;
+	context->blocks = blocks;
+}
+
+
+static void sha256_update(sha256_context* context, const void* data,
+	size_t length)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	context->length += length;
+
+	if (context->used > 0) {
+		size_t copied = 64 - context->used;
+		if (copied > length)
+			copied = length;
+		memcpy(context->buffer + context->used, bytes, copied);
+		context->used += copied;
+		bytes += copied;
+		length -= copied;
+		if (context->used < 64)
+			return;
+		context->blocks(context->state, context->buffer, 1);
+		context->used = 0;
+	}
+
+	context->blocks(context->state, bytes, length / 64);
+	bytes += length & ~(size_t)63;
+	length &= 63;
+	memcpy(context->buffer, bytes, length);
+	context->used = length;
+}
+
+
+static void sha256_final(sha256_context* context, uint8_t digest[32])
+{
+	uint64_t bits = context->length * 8;
+	uint8_t padding[72] = { 0x80 };
+	size_t count = (context->used < 56 ? 56 : 120) - context->used;
+	for (int i = 0; i < 8; i++)
+		padding[count + i] = bits >> (56 - 8 * i);
+	sha256_update(context, padding, count + 8);
+
+	for (int i = 0; i < 8; i++) {
+		digest[4 * i] = context->state[i] >> 24;
+		digest[4 * i + 1] = context->state[i] >> 16;
+		digest[4 * i + 2] = context->state[i] >> 8;
+		digest[4 * i + 3] = context->state[i];
+	}
+}
+
+#endif
@@ -1,6 +1,19 @@
 #include "ihex.h"
+#include "hexserver.h"
+#include "hexdecoder.h"
 
 #include <string.h>
+#ifdef HEXCRYPT_USE_MMAP
+#include <dirent.h>
+#endif
+
+static std::string slurp(const char* filename)
+{
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
 
 void TEST(const char* message, bool result)
 {
@@ -32,13 +45,1017 @@ void runs(const char* message, const char* filename)
 	hex2.Read("tests/02.hex");
 	TEST("Comparing", hex == hex2);
 
+	std::string written = slurp("tests/02.hex");
+	std::vector<char> buffer(hex.GeneratedSize());
+	TEST("Writing to memory", hex.Write(buffer.data(), buffer.size())
+		&& std::string(buffer.begin(), buffer.end()) == written);
+	TEST("Reading from memory", hex2.Read(written.data(), written.size())
+		&& hex == hex2);
+
+	HexFormat format;
+	format.lowercase = true;
+	format.crlf = false;
+	hex2.SetFormat(format);
+	buffer.resize(hex2.GeneratedSize());
+	hex2.Write(buffer.data(), buffer.size());
+	std::string lower(buffer.begin(), buffer.end());
+	TEST("Writing lowercase with LF", lower.find_first_of("ABCDEF\r")
+		== std::string::npos && hex2.Read(lower.data(), lower.size())
+		&& hex == hex2);
+
 	hex2.Cipher(key, 18);
 	hex.Read(filename);
 	TEST("Deciphering", hex == hex2);
+
+	CipherContext context(key, 18);
+	hex2.Cipher(context);
+	hex2.Cipher(context);
+	TEST("Reusing a cipher context", hex == hex2);
+
+	CipherContextCache cache(1);
+	hex2.Cipher(cache.Get(key, 18));
+	hex2.Cipher(cache.Get((const uint8_t*)"another key", 11));
+	hex2.Cipher(cache.Get((const uint8_t*)"another key", 11));
+	hex2.Cipher(cache.Get(key, 18));
+	TEST("Caching cipher contexts", hex == hex2);
+
+	// Only the first 256 bytes of a key are used
+	uint8_t longKey[1000];
+	for (int i = 0; i < 1000; i++)
+		longKey[i] = i * 7;
+	std::ofstream keyfile("tests/key.bin", std::ios::out | std::ios::binary);
+	keyfile.write((const char*)longKey, sizeof(longKey));
+	keyfile.close();
+	std::unique_ptr<CipherContext> loaded = CipherContext::FromFile("tests/key.bin");
+	remove("tests/key.bin");
+	hex.Cipher(CipherContext(longKey, sizeof(longKey)));
+	hex2.Cipher(*loaded);
+	TEST("Loading a key file", hex == hex2);
+	hex.Cipher(*loaded);
+	hex2.Cipher(CipherContext(longKey, 256));
+	TEST("Using 256 bytes of the key", hex == hex2);
+
+	hex.Cipher(context);
+	hex2.SetThreads(3, 7);
+	hex2.Cipher(context);
+	TEST("Ciphering in parallel", hex == hex2);
+	hex2.SetFormat(HexFormat());
+	std::vector<char> serial(hex.GeneratedSize());
+	std::vector<char> parallel(hex2.GeneratedSize());
+	hex.Write(serial.data(), serial.size());
+	hex2.Write(parallel.data(), parallel.size());
+	TEST("Writing in parallel", serial == parallel);
+	IntelHex hex3;
+	hex3.SetThreads(3, 7);
+	TEST("Reading in parallel", hex3.Read(parallel.data(), parallel.size())
+		&& hex2 == hex3 && hex3.Index().Segments() == hex2.Index().Segments());
+	hex.Cipher(context);
+	hex2.Cipher(context);
+	hex2.SetThreads(1);
+
+#if HEXCRYPT_STATS
+	struct Listener: public HexStatsListener {
+		int phases = 0;
+		void PhaseDone(const char*, double, const HexStats&) { phases++; }
+	} listener;
+	hex2.SetStatsListener(&listener);
+	hex2.ResetStats();
+	hex2.Read(filename);
+	hex2.Cipher(key, 18);
+	hex2.Write("tests/02.hex");
+	const HexStats& stats = hex2.Stats();
+	TEST("Counting statistics", stats.lines > 0 && stats.dataRecords > 0
+		&& stats.bytesCiphered > 0
+		&& stats.bytesWritten == slurp("tests/02.hex").size());
+	TEST("Notifying statistics listener", listener.phases == 3);
+	hex2.SetStatsListener(NULL);
+#endif
+
+	hex.Cipher(key, 18);
+	hex.Write("tests/02.hex");
+	std::string expected = slurp("tests/02.hex");
+	TEST("Streaming", IntelHex::Stream(filename, "tests/02.hex", key, 18));
+	TEST("Streamed output matches", slurp("tests/02.hex") == expected);
+
+	VerifyMismatch mismatch;
+	TEST("Verifying", IntelHex::Verify(filename, "tests/02.hex", context,
+		mismatch));
+	std::string wrong = expected;
+	// Swap two data bytes, this doesn't change the checksum
+	size_t data = 0;
+	do {
+		data = wrong.find("\n:10", data + 1) + 10;
+	} while (wrong.compare(data, 2, wrong, data + 2, 2) == 0);
+	std::swap(wrong[data], wrong[data + 2]);
+	std::swap(wrong[data + 1], wrong[data + 3]);
+	std::ofstream("tests/02.hex", std::ios::binary) << wrong;
+	TEST("Verifying bad data", !IntelHex::Verify(filename, "tests/02.hex",
+		context, mismatch) && mismatch.reason != NULL
+		&& mismatch.line == std::count(wrong.begin(), wrong.begin() + data, '\n') + 1);
+}
+
+void codecs()
+{
+	puts("Testing hexadecimal conversions");
+
+	char text[1025];
+	uint8_t expected[512];
+	for (int i = 0; i < 512; i++) {
+		expected[i] = i * 37 + 11;
+		snprintf(text + 2 * i, 3, i & 1 ? "%02x" : "%02X", expected[i]);
+	}
+
+	size_t count;
+	const hex_kernel* kernels = hex_kernels(&count);
+	for (size_t k = 0; k < count; k++) {
+		if (!kernels[k].available)
+			continue;
+
+		bool decoded = true;
+		bool located = true;
+		for (size_t len = 0; len <= 512; len += 7) {
+			uint8_t out[512];
+			uint8_t sum = 0, expectedSum = 0;
+			for (size_t i = 0; i < len; i++)
+				expectedSum += expected[i];
+			if (kernels[k].decode(text, len, out, &sum) != -1
+				|| memcmp(out, expected, len) != 0 || sum != expectedSum)
+				decoded = false;
+		}
+
+		for (size_t pos = 0; pos < 1024; pos += 5) {
+			uint8_t out[512];
+			uint8_t sum = 0;
+			char saved = text[pos];
+			text[pos] = pos & 2 ? 'g' : ':';
+			if (kernels[k].decode(text, 512, out, &sum) != (long)pos)
+				located = false;
+			text[pos] = saved;
+		}
+
+		bool encoded = true;
+		for (size_t len = 0; len <= 512; len += 7) {
+			char out[1024];
+			kernels[k].encode(expected, len, out, false);
+			char reference[1024];
+			hex_encode_scalar(expected, len, reference, false);
+			if (memcmp(out, reference, 2 * len) != 0)
+				encoded = false;
+			kernels[k].encode(expected, len, out, true);
+			hex_encode_scalar(expected, len, reference, true);
+			if (memcmp(out, reference, 2 * len) != 0)
+				encoded = false;
+		}
+		kernels[k].encode(expected, 512, text + 1, false);
+		if (memcmp(text + 1, "0B30557A9FC4E90E", 16) != 0)
+			encoded = false;
+		for (int i = 0; i < 512; i++)
+			snprintf(text + 2 * i, 3, i & 1 ? "%02x" : "%02X", expected[i]);
+
+		std::string message = std::string("Decoding with ") + kernels[k].name;
+		TEST(message.c_str(), decoded);
+		message = std::string("Locating errors with ") + kernels[k].name;
+		TEST(message.c_str(), located);
+		message = std::string("Encoding with ") + kernels[k].name;
+		TEST(message.c_str(), encoded);
+	}
+}
+
+void repack()
+{
+	puts("Testing record repacking");
+
+	const uint8_t* key = (const uint8_t*)"I'm an unsafe key";
+	IntelHex hex;
+	IntelHex hex2;
+	hex.Read("tests/01.hex");
+	hex2.Read("tests/01.hex");
+
+	hex.Repack(255);
+	size_t packed = hex.GeneratedSize();
+	TEST("Repacking to longer records", packed < hex2.GeneratedSize());
+
+	hex.Repack(16);
+	TEST("Repacking to the original length", hex == hex2);
+
+	hex.Repack(255);
+	hex2.Repack(255);
+	hex.Cipher(key, 18);
+	hex.Write("tests/02.hex");
+	hex.Read("tests/02.hex");
+	TEST("Reading repacked file", hex.GeneratedSize() == packed);
+	hex.Cipher(key, 18);
+	TEST("Deciphering repacked file", hex == hex2);
+}
+
+void addresses()
+{
+	puts("Testing address index");
+
+	IntelHex hex;
+	hex.Read("tests/01.hex");
+	const AddressIndex& index = hex.Index();
+	TEST("Merging contiguous records", index.Segments().size() == 1
+		&& index.Segments()[0] == AddressRange(0, 0x24C)
+		&& index.Overlaps().empty());
+	TEST("Finding data by address", hex.DataAt(0) && *hex.DataAt(0) == 0x52
+		&& hex.DataAt(0x24B) && *hex.DataAt(0x24B) == 0xCF
+		&& hex.DataAt(0x24C) == NULL);
+	TEST("Querying ranges", index.Contains(AddressRange(0x240, 0x1000))
+		&& !index.Contains(AddressRange(0x24C, 0x1000)));
+
+	hex.Read("tests/03.hex");
+	TEST("Resolving extended addresses", hex.DataAt(0x1FC02FF4)
+		&& *hex.DataAt(0x1FC02FF6) == 0xF8 && hex.DataAt(0x2FF4) == NULL);
+
+	const CipherContext context((const uint8_t*)"I'm an unsafe key", 18);
+	IntelHex hex2;
+	hex2.Read("tests/03.hex");
+	std::vector<AddressRange> everything(1, AddressRange(0, 0x100000000ull));
+	hex.Cipher(context);
+	hex2.Cipher(context, everything);
+	TEST("Ciphering all addresses", hex == hex2);
+
+	hex.Read("tests/01.hex");
+	hex2.Read("tests/01.hex");
+	std::vector<AddressRange> ranges;
+	ranges.push_back(AddressRange(0x108, 0x1000));
+	ranges.push_back(AddressRange(0x8, 0x20));
+	ranges.push_back(AddressRange(0x10, 0x18));
+	hex2.Cipher(context, ranges);
+	TEST("Ciphering address ranges", *hex2.DataAt(0x7) == *hex.DataAt(0x7)
+		&& *hex2.DataAt(0x107) == *hex.DataAt(0x107)
+		&& memcmp(hex2.DataAt(0x8), hex.DataAt(0x8), 0x18) != 0
+		&& memcmp(hex2.DataAt(0x108), hex.DataAt(0x108), 0x144) != 0);
+	hex2.Cipher(context, ranges);
+	TEST("Deciphering address ranges", hex == hex2
+		&& memcmp(hex2.DataAt(0x100), hex.DataAt(0x100), 16) == 0);
+
+	std::string text = slurp("tests/01.hex");
+	text.insert(0, ":0200080001C035\r\n");
+	hex.Read(text.data(), text.size());
+	TEST("Detecting overlaps", hex.Index().Overlaps().size() == 1
+		&& hex.Index().Overlaps()[0] == AddressRange(8, 10)
+		&& *hex.DataAt(8) == 0x5E);
+}
+
+void incremental()
+{
+	puts("Testing incremental ciphering");
+	const CipherContext context((const uint8_t*)"I'm an unsafe key", 18);
+	IntelHex plain;
+	IntelHex ciphered;
+	plain.Read("tests/03.hex");
+	ciphered.Read("tests/03.hex");
+	ciphered.Cipher(context);
+
+	// Change one data byte, the layout stays the same
+	std::string text = slurp("tests/03.hex");
+	size_t line = text.find(":10000000");
+	text.replace(line + 9, 2, "55");
+	text.replace(line + 41, 2, "ec");
+	IntelHex hex;
+	IntelHex expected;
+	hex.Read(text.data(), text.size());
+	expected.Read(text.data(), text.size());
+	expected.Cipher(context);
+	TEST("Reusing the whole keystream", hex.Cipher(context, plain, ciphered)
+		== plain.Index().Entries().size() && hex == expected);
+
+	// Remove a data record, the keystream changes from there
+	line = text.find(":10", line + 1);
+	text.erase(line, text.find('\n', line) + 1 - line);
+	hex.Read(text.data(), text.size());
+	expected.Read(text.data(), text.size());
+	expected.Cipher(context);
+	size_t reused = hex.Cipher(context, plain, ciphered);
+	TEST("Reusing the keystream up to a change", reused > 0
+		&& reused < plain.Index().Entries().size() && hex == expected);
+
+	hex.Read(text.data(), text.size());
+	const CipherContext other((const uint8_t*)"another key", 11);
+	expected.Cipher(context);
+	expected.Cipher(other);
+	TEST("Not reusing another key", hex.Cipher(other, plain, ciphered) == 0
+		&& hex == expected);
+}
+
+void copies()
+{
+	puts("Testing ciphering with many keys");
+	IntelHex hex;
+	hex.Read("tests/03.hex");
+	hex.SetThreads(2);
+
+	std::vector<std::string> keys;
+	std::vector<CipherContext> contexts;
+	std::vector<const CipherContext*> pointers;
+	for (int i = 0; i < 6; i++) {
+		keys.push_back("customer key " + std::to_string(i));
+		contexts.push_back(CipherContext((const uint8_t*)keys[i].data(),
+			keys[i].size()));
+	}
+	for (const CipherContext& context: contexts)
+		pointers.push_back(&context);
+
+	std::vector<IntelHex> copies;
+	hex.CipherCopies(pointers, copies);
+
+	bool same = copies.size() == contexts.size();
+	for (size_t i = 0; same && i < copies.size(); i++) {
+		IntelHex expected;
+		expected.Read("tests/03.hex");
+		expected.Cipher(contexts[i]);
+		std::vector<char> a(expected.GeneratedSize());
+		std::vector<char> b(copies[i].GeneratedSize());
+		expected.Write(a.data(), a.size());
+		copies[i].Write(b.data(), b.size());
+		same = a == b;
+	}
+	TEST("Ciphering copies with many keys", same);
+}
+
+void failures()
+{
+	puts("Testing parse errors");
+	IntelHex hex;
+	std::string text = slurp("tests/01.hex");
+	text.replace(text.find(":100010"), 1, "#");
+	text.replace(text.find(":1000200052C051") + 20, 1, "x");
+
+	std::vector<ParseFailure> failures;
+	TEST("Stopping at the first error",
+		!hex.Read(text.data(), text.size(), failures)
+		&& failures.size() == 1 && failures[0].status == kParseBadStart
+		&& failures[0].line == 2);
+
+	failures.clear();
+	TEST("Finding all errors",
+		!hex.Read(text.data(), text.size(), failures, true)
+		&& failures.size() == 2 && failures[1].status == kParseNotHex
+		&& failures[1].line == 3 && failures[1].column == 20);
+
+	TEST("Describing errors", failures[1].Message(text.data())
+		== "Parse error at 3:20: not an hexadecimal character\n"
+			+ text.substr(failures[1].offset, failures[1].length) + "\n"
+			+ std::string(20, ' ') + "^");
+
+	// Same errors when parsing in parallel
+	std::string large = slurp("tests/03.hex");
+	large.replace(large.find(":10", 20000), 1, "#");
+	large.replace(large.find(":10", 50000) + 12, 1, "x");
+	std::vector<ParseFailure> expected;
+	hex.Read(large.data(), large.size(), expected, true);
+	IntelHex parallel;
+	parallel.SetThreads(3, 7);
+	std::vector<ParseFailure> found;
+	parallel.Read(large.data(), large.size(), found, true);
+	bool same = expected.size() == 2 && found.size() == 2;
+	for (size_t i = 0; same && i < found.size(); i++) {
+		same = found[i].line == expected[i].line
+			&& found[i].column == expected[i].column
+			&& found[i].Message(large.data()) == expected[i].Message(large.data());
+	}
+	found.clear();
+	TEST("Finding errors in parallel", same
+		&& !parallel.Read(large.data(), large.size(), found)
+		&& found.size() == 1 && found[0].line == expected[0].line);
+
+	failures.clear();
+	text.resize(text.find(":00000001"));
+	TEST("Missing end record", !hex.Read(text.data(), text.size(), failures, true)
+		&& failures.back().status == kParseNoEnd);
+
+	failures.clear();
+	const char bad[] = ":00000004FC\r\n:01000004AB50\r\n:00000001FF\r\n";
+	TEST("Extended address of a wrong length",
+		!hex.Read(bad, sizeof(bad) - 1, failures, true) && failures.size() == 2
+		&& failures[0].status == kParseBadAddress && failures[0].line == 1
+		&& failures[1].status == kParseBadAddress && failures[1].line == 2);
+}
+
+void binaries()
+{
+	puts("Testing binary formats");
+	IntelHex hex;
+	IntelHex hex2;
+	hex.Read("tests/03.hex");
+
+	std::vector<uint8_t> packed;
+	hex.WriteContainer(packed);
+	TEST("Reading a container", hex2.ReadContainer(packed.data(), packed.size())
+		&& hex2.Index().Segments() == hex.Index().Segments());
+
+	bool same = true;
+	for (const AddressRange& segment: hex.Index().Segments()) {
+		for (uint64_t a = segment.start; a < segment.end; a++)
+			same = same && *hex.DataAt(a) == *hex2.DataAt(a);
+	}
+	TEST("Container data matches", same);
+
+	packed[20] ^= 1;
+	TEST("Container CRC is checked",
+		!hex2.ReadContainer(packed.data(), packed.size()));
+	hex.WriteContainer(packed, false);
+	packed[20] ^= 1;
+	TEST("Container without CRC",
+		hex2.ReadContainer(packed.data(), packed.size()));
+
+	hex.Read("tests/01.hex");
+	std::vector<uint8_t> image;
+	hex.WriteBinary(image, 0xA5);
+	const std::vector<AddressRange>& segments = hex.Index().Segments();
+	uint64_t base = segments.front().start;
+	same = image.size() == segments.back().end - base;
+	for (uint64_t a = base; a < segments.back().end; a++) {
+		const uint8_t* data = hex.DataAt(a);
+		same = same && image[a - base] == (data ? *data : 0xA5);
+	}
+	TEST("Writing a binary image", same);
+
+	TEST("Reading a binary image", hex2.ReadBinary(image.data(), image.size(),
+		base) && hex2.Index().Segments().size() == 1
+		&& hex2.Index().Segments()[0] == AddressRange(base, base + image.size())
+		&& *hex2.DataAt(segments.back().end - 1)
+			== *hex.DataAt(segments.back().end - 1));
+
+	TEST("Binary image above 64K", hex2.ReadBinary(image.data(), image.size(),
+		0x1FFF8) && hex2.DataAt(0x1FFF7) == NULL
+		&& *hex2.DataAt(0x20000) == image[8]);
+}
+
+void engines()
+{
+	puts("Testing the counter based ciphers");
+
+	// FIPS-197 appendix C.1
+	uint8_t key[44];
+	for (int i = 0; i < 32; i++)
+		key[i] = i;
+	const uint8_t plain[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+	const uint8_t expected[16] = { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04,
+		0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+	aes128_key expanded;
+	aes128_expand_key(key, &expanded);
+	size_t count;
+	const aes_kernel* aes = aes_kernels(&count);
+	for (size_t k = 0; k < count; k++) {
+		if (!aes[k].available)
+			continue;
+		uint8_t blocks[5 * 16];
+		for (int b = 0; b < 5; b++)
+			memcpy(blocks + 16 * b, plain, 16);
+		aes[k].encrypt(&expanded, blocks, blocks, 5);
+		bool same = true;
+		for (int b = 0; b < 5; b++)
+			same = same && memcmp(blocks + 16 * b, expected, 16) == 0;
+		std::string message = std::string("AES-128 with ") + aes[k].name;
+		TEST(message.c_str(), same);
+	}
+
+	// Counter ending in 0xff, so the second block carries
+	memset(key + 16, 0, 16);
+	key[31] = 0xff;
+	const uint8_t ctr[24] = { 0x39, 0xbb, 0xd9, 0xed, 0xf8, 0x29, 0x06, 0x3d,
+		0x5e, 0x7e, 0x70, 0x2e, 0xbe, 0xa4, 0x0a, 0x38, 0x13, 0x37, 0xd5, 0x31,
+		0x4c, 0xe3, 0xde, 0x09 };
+	std::unique_ptr<CipherEngine> engine
+		= CipherEngine::Create("aes-ctr", key, 32);
+	uint8_t data[64] = { 0 };
+	engine->Apply(0, data, 24);
+	bool same = memcmp(data, ctr, 24) == 0;
+	memset(data, 0, sizeof(data));
+	engine->Apply(5, data, 19);
+	TEST("AES-CTR keystream", same && memcmp(data, ctr + 5, 19) == 0);
+	TEST("Short key rejected", !CipherEngine::Create("aes-ctr", key, 15)
+		&& !CipherEngine::Create("chacha20", key, 31)
+		&& !CipherEngine::Create("arc4", key, 32));
+
+	// RFC 8439 section 2.3.2, block 1 is at address 64
+	const uint8_t nonce[12] = { 0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+	const uint8_t block[16] = { 0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+		0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4 };
+	for (int i = 0; i < 32; i++)
+		key[i] = i;
+	memcpy(key + 32, nonce, 12);
+	engine = CipherEngine::Create("chacha20", key, 44);
+	memset(data, 0, sizeof(data));
+	engine->Apply(64, data, 16);
+	TEST("ChaCha20 keystream", memcmp(data, block, 16) == 0);
+
+	uint32_t words[8];
+	for (int i = 0; i < 8; i++)
+		words[i] = 0x03020100 + 0x04040404 * i;
+	uint32_t nonceWords[3] = { 0x09000000, 0x4a000000, 0 };
+	uint8_t reference[6 * 64];
+	chacha20_blocks_scalar(words, nonceWords, 1, reference, 6);
+	const chacha_kernel* chacha = chacha_kernels(&count);
+	for (size_t k = 0; k < count; k++) {
+		if (!chacha[k].available)
+			continue;
+		uint8_t blocks[6 * 64];
+		chacha[k].blocks(words, nonceWords, 1, blocks, 6);
+		std::string message = std::string("ChaCha20 with ") + chacha[k].name;
+		TEST(message.c_str(), memcmp(blocks, reference, sizeof(blocks)) == 0
+			&& memcmp(blocks, block, 16) == 0);
+	}
+
+	IntelHex hex;
+	IntelHex hex2;
+	hex.Read("tests/03.hex");
+	hex2.Read("tests/03.hex");
+	hex.Cipher(*engine);
+	TEST("Ciphering with an engine", !(hex == hex2));
+	hex.Cipher(*engine);
+	TEST("Deciphering with an engine", hex == hex2);
+
+	hex.Cipher(*engine);
+	hex2.SetThreads(3, 7);
+	hex2.Cipher(*engine);
+	TEST("Engine in parallel", hex == hex2);
+}
+
+void server()
+{
+	puts("Testing the server");
+
+	std::ofstream("tests/server.key") << "I'm an unsafe key";
+	std::string socket = "/tmp/hexcrypt-test-" + std::to_string(getpid());
+	HexServer server;
+	TEST("Server setup", server.AddKey("test", "tests/server.key")
+		&& server.Listen(socket.c_str()));
+	std::thread thread([&]() { server.Run(2); });
+
+	struct stat info;
+	TEST("Server socket private", stat(socket.c_str(), &info) == 0
+		&& (info.st_mode & 0777) == 0600);
+	HexServer second;
+	TEST("Keeping a running server's socket", !second.Listen(socket.c_str())
+		&& errno == EADDRINUSE);
+
+	IntelHex expected;
+	IntelHex hex;
+	expected.Read("tests/03.hex");
+	expected.Cipher((const uint8_t*)"I'm an unsafe key", 17);
+	std::string error;
+	TEST("Ciphering a file on the server", HexServer::Request(socket.c_str(),
+		"test", HexFormat(), "tests/03.hex", "tests/02.hex", error)
+		&& hex.Read("tests/02.hex") && hex == expected);
+
+	std::istringstream input(slurp("tests/03.hex"));
+	std::ostringstream output;
+	TEST("Streaming through the server", HexServer::Request(socket.c_str(),
+		"test", HexFormat(), input, output, error)
+		&& hex.Read(output.str().data(), output.str().size())
+		&& hex == expected);
+
+	TEST("Unknown key on the server", !HexServer::Request(socket.c_str(),
+		"other", HexFormat(), "tests/03.hex", "tests/02.hex", error)
+		&& error == "Unknown key other");
+
+	server.Stop();
+	thread.join();
+
+	// Left by a server which was killed
+	std::string stale = socket + "-stale";
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, stale.c_str());
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	bind(fd, (sockaddr*)&address, sizeof(address));
+	close(fd);
+	HexServer restarted;
+	TEST("Replacing a stale socket", restarted.Listen(stale.c_str()));
+	unlink("tests/server.key");
+}
+
+void digests()
+{
+	puts("Testing the digests");
+
+	// FIPS 180-4 examples
+	const char* two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	const uint8_t abc[32] = { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3,
+		0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+	const uint8_t blocks[32] = { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+		0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59,
+		0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 };
+	size_t count;
+	const sha256_kernel* kernels = sha256_kernels(&count);
+	for (size_t k = 0; k < count; k++) {
+		if (!kernels[k].available)
+			continue;
+		uint8_t digest[32];
+		sha256_context context;
+		sha256_init(&context, kernels[k].blocks);
+		sha256_update(&context, "abc", 3);
+		sha256_final(&context, digest);
+		bool same = memcmp(digest, abc, 32) == 0;
+		sha256_init(&context, kernels[k].blocks);
+		for (const char* c = two; *c; c++)
+			sha256_update(&context, c, 1);
+		sha256_final(&context, digest);
+		std::string message = std::string("SHA-256 with ") + kernels[k].name;
+		TEST(message.c_str(), same && memcmp(digest, blocks, 32) == 0);
+	}
+
+	IntelHex hex;
+	hex.Read("tests/03.hex");
+	hex.SetDigests(true);
+	std::vector<char> text(hex.GeneratedSize());
+	hex.Write(text.data(), text.size());
+
+	// The payload of the data records, decoded from the text
+	std::string payload;
+	std::istringstream lines(std::string(text.data(), text.size()));
+	std::string line;
+	while (std::getline(lines, line)) {
+		if (line.compare(7, 2, "00") != 0)
+			continue;
+		int size = strtol(line.substr(1, 2).c_str(), NULL, 16);
+		for (int i = 0; i < size; i++)
+			payload += (char)strtol(line.substr(9 + 2 * i, 2).c_str(), NULL, 16);
+	}
+
+	HexDigests expected;
+	HexDigester digester;
+	digester.AddText(text.data(), text.size());
+	digester.AddPayload((const uint8_t*)payload.data(), payload.size());
+	digester.Finish(expected);
+	const HexDigests& digests = hex.Digests();
+	TEST("Digests of the text", memcmp(digests.textSha256,
+		expected.textSha256, 32) == 0
+		&& digests.textCrc32 == crc32_update(0, (const uint8_t*)text.data(),
+			text.size()));
+	TEST("Digests of the payload", memcmp(digests.payloadSha256,
+		expected.payloadSha256, 32) == 0
+		&& digests.payloadCrc32 == expected.payloadCrc32);
+
+	IntelHex hex2;
+	hex2.Read("tests/03.hex");
+	hex2.SetDigests(true);
+	hex2.SetThreads(3, 7);
+	hex2.Write(text.data(), text.size());
+	std::ostringstream printed, printed2;
+	hex.Digests().Print(printed);
+	hex2.Digests().Print(printed2);
+	TEST("Digests in parallel", printed.str() == printed2.str());
+}
+
+void compression()
+{
+	puts("Testing compressed files");
+
+	IntelHex hex;
+	IntelHex hex2;
+	hex.Read("tests/03.hex");
+
+	// Data which isn't compressed goes through unchanged
+	std::string text = slurp("tests/03.hex");
+	MemoryStreamBuffer source(text.data(), text.size());
+	DecompressStreamBuffer plain(&source);
+	std::istream in(&plain);
+	std::ostringstream copy;
+	copy << in.rdbuf();
+	TEST("Uncompressed data passes through", copy.str() == text
+		&& plain.Type() == kCompressionNone);
+
+#if HEXCRYPT_HAVE_ZLIB
+	TEST("Writing a .gz file", hex.Write("tests/02.hex.gz"));
+	std::string packed = slurp("tests/02.hex.gz");
+	TEST("Reading a .gz file", hex2.Read("tests/02.hex.gz") && hex == hex2
+		&& packed.size() < hex.GeneratedSize() / 2);
+
+	std::vector<char> unpacked;
+	const char* error;
+	TEST("Truncated gzip data", !decompress_buffer(kCompressionGzip,
+		packed.data(), packed.size() - 10, unpacked, error) && error != NULL);
+
+	// Detected by its contents, whichever way it is read
+	std::ofstream("tests/gzip.hex", std::ios::binary) << packed;
+	IntelHex detected;
+	IntelHex detectedQuietly;
+	std::vector<ParseFailure> failures;
+	TEST("Reading gzip data named .hex", detected.Read("tests/gzip.hex")
+		&& detected == hex
+		&& detectedQuietly.Read("tests/gzip.hex", failures, true)
+		&& failures.empty() && detectedQuietly == hex);
+	unlink("tests/gzip.hex");
+
+	// Larger than the parser blocks, with errors after the first one
+	std::vector<uint8_t> bytes(300000);
+	for (size_t i = 0; i < bytes.size(); i++)
+		bytes[i] = i * 13 + (i >> 9);
+	IntelHex large;
+	large.ReadBinary(bytes.data(), bytes.size(), 0x10000);
+	std::string largeText(large.GeneratedSize(), ' ');
+	large.Write(&largeText[0], largeText.size());
+	TEST("Reading large .gz files in blocks", large.Write("tests/large.hex.gz")
+		&& detected.Read("tests/large.hex.gz") && detected == large);
+
+	largeText.replace(largeText.find(":10", 400000) + 5, 1, "x");
+	largeText.replace(largeText.find(":10", 600000), 1, "#");
+	{
+		std::filebuf file;
+		file.open("tests/large.hex.gz", std::ios::out | std::ios::binary);
+		CompressStreamBuffer compressor(&file, kCompressionGzip);
+		compressor.sputn(largeText.data(), largeText.size());
+	}
+	std::vector<ParseFailure> inMemory;
+	detected.Read(largeText.data(), largeText.size(), inMemory, true);
+	failures.clear();
+	bool same = !detected.Read("tests/large.hex.gz", failures, true)
+		&& failures.size() == 2 && inMemory.size() == 2;
+	for (size_t i = 0; same && i < failures.size(); i++) {
+		same = failures[i].status == inMemory[i].status
+			&& failures[i].line == inMemory[i].line
+			&& failures[i].column == inMemory[i].column;
+	}
+	TEST("Finding errors in large .gz files", same);
+	unlink("tests/large.hex.gz");
+
+	const uint8_t* key = (const uint8_t*)"I'm an unsafe key";
+	TEST("Streaming a .gz file", IntelHex::Stream("tests/02.hex.gz",
+		"tests/02.hex", key, 18));
+	hex.Cipher(key, 18);
+	TEST("Streamed .gz output matches", hex2.Read("tests/02.hex")
+		&& hex == hex2);
+	unlink("tests/02.hex.gz");
+#endif
+}
+
+void patches()
+{
+	puts("Testing patches");
+
+	// Across a 64K boundary, so the patch needs extended address records
+	const uint32_t base = 0x1FF00;
+	std::vector<uint8_t> data(10000);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i * 7 + (i >> 8);
+	std::vector<uint8_t> changed = data;
+	changed[100] ^= 1;
+	for (int i = 0; i < 4; i++)
+		changed[5000 + i] += 3;
+	changed.insert(changed.end(), 20, 0x55);
+
+	IntelHex old;
+	IntelHex updated;
+	old.ReadBinary(data.data(), data.size(), base);
+	updated.ReadBinary(changed.data(), changed.size(), base);
+	std::vector<AddressRange> diff = updated.Diff(old);
+	TEST("Diff of identical images", old.Diff(old).empty());
+	TEST("Diff finds the changed bytes", diff.size() == 3
+		&& diff[0] == AddressRange(base + 100, base + 101)
+		&& diff[1] == AddressRange(base + 5000, base + 5004)
+		&& diff[2] == AddressRange(base + 10000, base + 10020)
+		&& updated.Diff(old, 16) == diff);
+
+	// Records are 16 bytes, the end is split in two
+	const uint8_t* key = (const uint8_t*)"I'm an unsafe key";
+	old.Cipher(key, 18);
+	updated.Cipher(key, 18);
+	IntelHex patch;
+	patch.Patch(old, updated);
+	TEST("Patch has the changed records", patch.Index().Entries().size() == 4
+		&& *patch.DataAt(base + 100) == *updated.DataAt(base + 100)
+		&& *patch.DataAt(base + 10019) == *updated.DataAt(base + 10019)
+		&& patch.DataAt(base + 200) == NULL);
+
+	std::vector<char> text(patch.GeneratedSize());
+	IntelHex reread;
+	TEST("Patch is a valid file", patch.Write(text.data(), text.size())
+		&& reread.Read(text.data(), text.size()) && reread == patch);
+}
+
+void cache()
+{
+#ifdef HEXCRYPT_USE_MMAP
+	puts("Testing the parsed image cache");
+
+	const char* directory = "tests/cache";
+	const char* scratch = "tests/cache.hex";
+	std::string text = slurp("tests/03.hex");
+	std::ofstream(scratch, std::ios::binary) << text;
+
+	// Nothing is parsed when the cache is used. Without statistics, only the
+	// result is checked.
+	bool counted = HEXCRYPT_STATS;
+	IntelHex plain;
+	IntelHex parsed;
+	IntelHex cached;
+	plain.Read("tests/03.hex");
+	parsed.SetCache(directory);
+	cached.SetCache(directory);
+	TEST("Parsing into the cache", parsed.Read(scratch)
+		&& (!counted || parsed.Stats().lines > 0) && parsed == plain);
+	TEST("Reading from the cache", cached.Read(scratch)
+		&& cached.Stats().lines == 0 && cached == plain
+		&& cached.Index().Segments() == plain.Index().Segments());
+
+	// A record pointing out of the payload makes the file parsed again
+	std::string cacheFile;
+	DIR* files = opendir(directory);
+	while (dirent* entry = readdir(files)) {
+		if (entry->d_name[0] != '.')
+			cacheFile = std::string(directory) + "/" + entry->d_name;
+	}
+	closedir(files);
+	std::fstream corrupt(cacheFile.c_str(),
+		std::ios::in | std::ios::out | std::ios::binary);
+	ImageCacheHeader header;
+	corrupt.read((char*)&header, sizeof(header));
+	uint32_t offset = header.payload;
+	corrupt.seekp(sizeof(header) + cache_padded(header.pathLength));
+	corrupt.write((const char*)&offset, sizeof(offset));
+	corrupt.close();
+	IntelHex hostile;
+	hostile.SetCache(directory);
+	TEST("Rejecting records out of the cached payload",
+		hostile.Read(scratch) && (!counted || hostile.Stats().lines > 0)
+		&& hostile == plain);
+
+	// Same size and time, but different contents
+	struct stat st;
+	stat(scratch, &st);
+	for (char& c: text) {
+		if (c >= 'A' && c <= 'F')
+			c += 'a' - 'A';
+	}
+	std::ofstream(scratch, std::ios::binary) << text;
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	utimensat(AT_FDCWD, scratch, times, 0);
+	IntelHex changed;
+	changed.SetCache(directory);
+	TEST("Changed files are parsed again", changed.Read(scratch)
+		&& (!counted || changed.Stats().lines > 0) && changed == plain);
+
+	std::ofstream(scratch, std::ios::binary) << ":00000001FF\r\n";
+	IntelHex empty;
+	empty.SetCache(directory);
+	TEST("Cache follows the file", empty.Read(scratch)
+		&& empty.Index().Entries().empty());
+
+	DIR* entries = opendir(directory);
+	while (dirent* entry = readdir(entries)) {
+		if (entry->d_name[0] != '.')
+			unlink((std::string(directory) + "/" + entry->d_name).c_str());
+	}
+	closedir(entries);
+	rmdir(directory);
+	unlink(scratch);
+#endif
+}
+
+void pipeline()
+{
+	puts("Testing the I/O pipeline");
+
+	// Small blocks, so both sides wait for each other
+	std::string text = slurp("tests/03.hex");
+	std::stringbuf source(text, std::ios::in);
+	std::string copy;
+	{
+		ReadAheadStreamBuffer readAhead(&source, 1000, 2);
+		std::istream in(&readAhead);
+		std::ostringstream out;
+		out << in.rdbuf();
+		copy = out.str();
+	}
+	TEST("Reading ahead", copy == text);
+
+	std::stringbuf sink;
+	WriteBehindStreamBuffer writeBehind(&sink, 1000, 2);
+	std::ostream out(&writeBehind);
+	for (size_t i = 0; i < text.size(); i += 77)
+		out.write(text.data() + i, std::min<size_t>(77, text.size() - i));
+	TEST("Writing behind", writeBehind.Finish() && sink.str() == text);
+
+	std::stringbuf full(std::ios::in);
+	WriteBehindStreamBuffer failing(&full, 1000, 2);
+	std::ostream bad(&failing);
+	bad.write(text.data(), text.size());
+	TEST("Write errors are reported", !failing.Finish());
+
+	// Stream goes through the pipeline
+	const uint8_t* key = (const uint8_t*)"I'm an unsafe key";
+	IntelHex hex;
+	IntelHex hex2;
+	hex.Read("tests/03.hex");
+	hex.Cipher(key, 18);
+	TEST("Streaming through the pipeline", IntelHex::Stream("tests/03.hex",
+		"tests/02.hex", key, 18) && hex2.Read("tests/02.hex") && hex == hex2);
+}
+
+struct DecodedData {
+	const IntelHex* plain;
+	size_t bytes;
+	size_t mismatches;
+	int records;
+	int stopAt;
+};
+
+
+static int check_decoded(void* cookie, const hex_decoder_record* record)
+{
+	DecodedData* decoded = (DecodedData*)cookie;
+	if (++decoded->records == decoded->stopAt)
+		return 1;
+	if (record->type != 0)
+		return 0;
+	for (int i = 0; i < record->length; i++) {
+		const uint8_t* expected = decoded->plain->DataAt(record->absolute + i);
+		if (expected == NULL || *expected != record->data[i])
+			decoded->mismatches++;
+	}
+	decoded->bytes += record->length;
+	return 0;
+}
+
+
+/// Push the text in chunks of 1 to 7 bytes.
+static int decode(hex_decoder* decoder, const std::string& text)
+{
+	int result = kHexDecoderOK;
+	for (size_t i = 0, size = 1; i < text.size() && result == kHexDecoderOK;
+			i += size, size = size % 7 + 1) {
+		result = hex_decoder_push(decoder, (const uint8_t*)text.data() + i,
+			std::min(size, text.size() - i));
+	}
+	return result == kHexDecoderOK ? hex_decoder_finish(decoder) : result;
+}
+
+
+void decoder()
+{
+	puts("Testing the streaming decoder");
+
+	const uint8_t* key = (const uint8_t*)"I'm an unsafe key";
+	IntelHex plain;
+	IntelHex ciphered;
+	plain.Read("tests/03.hex");
+	ciphered.Read("tests/03.hex");
+	ciphered.Cipher(key, 18);
+	std::vector<char> text(ciphered.GeneratedSize());
+	ciphered.Write(text.data(), text.size());
+	std::string file(text.data(), text.size());
+
+	size_t payload = 0;
+	for (const AddressIndex::Entry& entry: plain.Index().Entries())
+		payload += entry.size;
+
+	TEST("Decoder state is under 1 KB", sizeof(hex_decoder) < 1024);
+
+	hex_decoder state;
+	DecodedData decoded = { &plain, 0, 0, 0, 0 };
+	hex_decoder_init(&state, key, 18, check_decoded, &decoded);
+	TEST("Decoding in small chunks", decode(&state, file) == kHexDecoderDone
+		&& decoded.mismatches == 0 && decoded.bytes == payload);
+
+	uint8_t copy[256];
+	CipherContext(key, 18).CopyState(copy);
+	decoded = { &plain, 0, 0, 0, 0 };
+	hex_decoder_init_state(&state, copy, check_decoded, &decoded);
+	TEST("Decoding from a copied state", decode(&state, file)
+		== kHexDecoderDone && decoded.mismatches == 0);
+
+	std::string broken = file;
+	size_t third = broken.find('\n', broken.find('\n') + 1) + 1;
+	broken[third + 10] = broken[third + 10] == '0' ? '1' : '0';
+	hex_decoder_init(&state, key, 18, NULL, NULL);
+	TEST("Decoder checksum error", decode(&state, broken)
+		== kHexDecoderChecksum && state.lines == 3);
+
+	decoded = { &plain, 0, 0, 0, 5 };
+	hex_decoder_init(&state, key, 18, check_decoded, &decoded);
+	TEST("Decoder stopped by the callback", decode(&state, file)
+		== kHexDecoderAborted && decoded.records == 5);
+
+	hex_decoder_init(&state, key, 18, NULL, NULL);
+	TEST("Decoder without an end record", decode(&state,
+		file.substr(0, third)) == kHexDecoderNoEnd);
 }
 
 int main(void)
 {
 	runs("Testing with 16-bit hex file", "tests/01.hex");
 	runs("Testing with 32-bit hex file", "tests/03.hex");
+	codecs();
+	repack();
+	addresses();
+	incremental();
+	copies();
+	failures();
+	binaries();
+	engines();
+	server();
+	digests();
+	compression();
+	decoder();
+	pipeline();
+	patches();
+	cache();
 }